@@ -4,32 +4,97 @@ package bridge
 import (
 	"io"
 	"sync"
+	"time"
 
 	"github.com/fragglet/ipxbox/ipx"
+	"github.com/fragglet/ipxbox/metrics"
+	"github.com/fragglet/ipxbox/pool"
 )
 
+var (
+	metricFwdPackets = metrics.NewCounter("ipxbox.bridge.fwd_packets")
+	metricFwdBytes   = metrics.NewCounter("ipxbox.bridge.fwd_bytes")
+
+	// TableSize is the maximum number of IPX addresses learned from
+	// each input device.
+	TableSize = 1024
+
+	// TableTTL is how long a learned address stays in the table
+	// without being seen again.
+	TableTTL = 10 * time.Minute
+)
+
+// BatchReader is an optional interface implemented by input devices that
+// can return several received packets per call; the returned slices are
+// only valid until the next call.
+type BatchReader interface {
+	ReadBatch(payloads [][]byte) (int, error)
+}
+
+// Flusher is an optional interface implemented by output devices that
+// stage written packets and transmit them in batches. The bridge calls
+// Flush once it has forwarded everything from a batch of input packets,
+// so that a burst costs a single transmit call.
+type Flusher interface {
+	Flush() error
+}
+
+// Number of packets read per call from inputs supporting BatchReader.
+const readBatchSize = 16
+
 func copyPackets(in io.ReadCloser, out io.WriteCloser) {
-	localAddresses := map[ipx.Addr]bool{}
-	for {
-		buf := make([]byte, 1500)
-		n, err := in.Read(buf)
-		if err != nil {
-			break
-		}
-		buf = buf[0:n]
+	localAddresses := newAddressTable(TableSize, TableTTL)
 
-		var hdr ipx.Header
-		if err := hdr.UnmarshalBinary(buf); err != nil {
-			continue
+	forward := func(buf []byte, now time.Time) {
+		dest, src, err := ipx.PeekAddresses(buf)
+		if err != nil {
+			return
 		}
 		// Remember every address we see from the input device, and
 		// don't copy packets if the destination is on the input device.
-		localAddresses[hdr.Src.Addr] = true
-		if localAddresses[hdr.Dest.Addr] {
-			continue
+		localAddresses.learn(src, now)
+		if localAddresses.contains(dest, now) {
+			return
 		}
+		metricFwdPackets.Add(1)
+		metricFwdBytes.Add(uint64(len(buf)))
 		out.Write(buf)
 	}
+
+	flush := func() {}
+	if f, ok := out.(Flusher); ok {
+		flush = func() { f.Flush() }
+	}
+
+	if br, ok := in.(BatchReader); ok {
+		// The input can hand over everything that has accumulated
+		// in one call, so a burst of packets costs one wakeup.
+		payloads := make([][]byte, readBatchSize)
+		for {
+			n, err := br.ReadBatch(payloads)
+			if err != nil {
+				break
+			}
+			now := time.Now()
+			for _, buf := range payloads[0:n] {
+				forward(buf, now)
+			}
+			flush()
+		}
+	} else {
+		// A single pooled buffer is reused for every packet;
+		// out.Write() does not retain the slice it is given.
+		b := pool.Get()
+		defer b.Release()
+		for {
+			n, err := in.Read(b.Data[0:pool.BufferSize])
+			if err != nil {
+				break
+			}
+			forward(b.Data[0:n], time.Now())
+			flush()
+		}
+	}
 	in.Close()
 	out.Close()
 }
@@ -0,0 +1,69 @@
+package bridge
+
+import (
+	"container/list"
+	"time"
+
+	"github.com/fragglet/ipxbox/ipx"
+)
+
+// addressTable is a fixed-capacity table of learned IPX addresses, like
+// the CAM table in a hardware switch. When the table is full the least
+// recently seen address is evicted, and entries age out after a TTL, so
+// the table stays bounded no matter how many addresses churn past and a
+// lookup costs the same however long the bridge runs.
+type addressTable struct {
+	capacity int
+	ttl      time.Duration
+	entries  map[ipx.Addr]*list.Element
+
+	// order lists the entries from most (front) to least (back)
+	// recently seen.
+	order *list.List
+}
+
+type tableEntry struct {
+	addr     ipx.Addr
+	lastSeen time.Time
+}
+
+func newAddressTable(capacity int, ttl time.Duration) *addressTable {
+	return &addressTable{
+		capacity: capacity,
+		ttl:      ttl,
+		entries:  map[ipx.Addr]*list.Element{},
+		order:    list.New(),
+	}
+}
+
+// learn records that a packet was just seen from the given address,
+// evicting the least recently seen address if the table is full.
+func (t *addressTable) learn(addr ipx.Addr, now time.Time) {
+	if element, ok := t.entries[addr]; ok {
+		element.Value.(*tableEntry).lastSeen = now
+		t.order.MoveToFront(element)
+		return
+	}
+	if t.order.Len() >= t.capacity {
+		oldest := t.order.Back()
+		delete(t.entries, oldest.Value.(*tableEntry).addr)
+		t.order.Remove(oldest)
+	}
+	t.entries[addr] = t.order.PushFront(&tableEntry{addr: addr, lastSeen: now})
+}
+
+// contains returns true if the given address has been seen recently.
+// Entries that have aged beyond the TTL are removed as they are found.
+func (t *addressTable) contains(addr ipx.Addr, now time.Time) bool {
+	element, ok := t.entries[addr]
+	if !ok {
+		return false
+	}
+	entry := element.Value.(*tableEntry)
+	if now.Sub(entry.lastSeen) > t.ttl {
+		delete(t.entries, addr)
+		t.order.Remove(element)
+		return false
+	}
+	return true
+}
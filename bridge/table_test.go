@@ -0,0 +1,59 @@
+package bridge
+
+import (
+	"testing"
+	"time"
+
+	"github.com/fragglet/ipxbox/ipx"
+)
+
+func makeAddr(i int) ipx.Addr {
+	return ipx.Addr{0x02, 0, 0, 0, byte(i >> 8), byte(i)}
+}
+
+func TestTableLearnAndLookup(t *testing.T) {
+	table := newAddressTable(4, time.Minute)
+	now := time.Now()
+	table.learn(makeAddr(1), now)
+	if !table.contains(makeAddr(1), now) {
+		t.Errorf("learned address not found")
+	}
+	if table.contains(makeAddr(2), now) {
+		t.Errorf("unlearned address found")
+	}
+}
+
+func TestTableEvictsLeastRecentlySeen(t *testing.T) {
+	table := newAddressTable(4, time.Minute)
+	now := time.Now()
+	for i := 1; i <= 4; i++ {
+		table.learn(makeAddr(i), now)
+	}
+	// Refresh address 1, then learn a fifth address; address 2 is now
+	// the least recently seen and should be the one evicted.
+	table.learn(makeAddr(1), now.Add(time.Second))
+	table.learn(makeAddr(5), now.Add(2*time.Second))
+	if table.contains(makeAddr(2), now.Add(2*time.Second)) {
+		t.Errorf("least recently seen address was not evicted")
+	}
+	for _, i := range []int{1, 3, 4, 5} {
+		if !table.contains(makeAddr(i), now.Add(2*time.Second)) {
+			t.Errorf("address %d missing from table", i)
+		}
+	}
+	if len(table.entries) > 4 {
+		t.Errorf("table grew beyond capacity: %d entries", len(table.entries))
+	}
+}
+
+func TestTableEntriesExpire(t *testing.T) {
+	table := newAddressTable(4, time.Minute)
+	now := time.Now()
+	table.learn(makeAddr(1), now)
+	if !table.contains(makeAddr(1), now.Add(30*time.Second)) {
+		t.Errorf("address expired too soon")
+	}
+	if table.contains(makeAddr(1), now.Add(2*time.Minute)) {
+		t.Errorf("address did not expire")
+	}
+}
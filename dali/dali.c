@@ -1,12 +1,38 @@
 
+#include <dos.h>
+#include <i86.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-#include <process.h>
+#include <unistd.h>
 
 #include "ipx.h"
 #include "dbipx.h"
 
+// GoResident terminates and stays resident, giving back to DOS
+// everything that is not needed once the driver is up: our copy of the
+// environment block, the free near heap above the break, and the
+// unused part of the stack. In the small memory model the init-only
+// code (DNS resolution, argument parsing) cannot be discarded
+// piecemeal, but it is a small fraction of the image next to the mTCP
+// runtime, which must stay resident anyway. The mTCP packet buffers
+// are allocated on the near heap at startup, so the break marks the
+// end of everything the ISRs touch.
+static void GoResident(void)
+{
+	unsigned short far *env_seg = MK_FP(_psp, 0x2c);
+	unsigned int resident_paras;
+
+	_dos_freemem(*env_seg);
+	*env_seg = 0;
+
+	// Paragraphs from the PSP to the start of the data segment, plus
+	// the data segment up to the current heap break.
+	resident_paras = (FP_SEG(&dbipx_local_addr) - _psp)
+	               + (((unsigned int) sbrk(0)) + 15) / 16;
+
+	_dos_keep(0, resident_paras);
+}
+
 int main(int argc, char *argv[])
 {
 	char *addr;
@@ -24,14 +50,8 @@ int main(int argc, char *argv[])
 
 	HookIPXVector();
 
-	// "Poor man's TSR" where we run command.com
-	// Temporary hack until we convert this to a real TSR
-	{
-		const char * const args[] = {"z:\\command.com", NULL};
-		spawnv(P_WAIT, args[0], args);
-	}
-	printf("DALI exiting.\n");
+	printf("DALI is now resident.\n");
+	GoResident();
 
 	return 0;
 }
-
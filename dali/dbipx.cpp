@@ -1,6 +1,7 @@
 
 // Implementation of DOSbox UDP protocol, using the DOS mTCP stack.
 
+#include <i86.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,11 +21,35 @@ extern "C" {
 
 #define REG_ATTEMPTS 5
 
+// Protocol extensions are negotiated during registration: we append the
+// extension magic and a flags word to our registration packet, and the
+// server replies in kind with the flags it accepted. Stock DOSBox
+// servers ignore the trailer and reply with a bare header, in which
+// case no extensions are active.
+#define EXTENSION_FLAG_AGGREGATION  0x0001
+#define EXTENSION_FLAG_LARGE_MTU    0x0002
+
+// The largest packet we can carry; mTCP's buffers and the underlying
+// packet driver cap us at the Ethernet MTU regardless of what the
+// server could grant.
+#define DBIPX_MAX_MTU  1500
+
+static const unsigned char extension_magic[4] = {'I', 'P', 'X', 'E'};
+
+struct registration_packet {
+	struct ipx_header hdr;
+	unsigned char magic[4];
+	unsigned short flags;
+	unsigned short mtu;
+};
+
 static IpAddr_t server_addr;
 static int udp_port;
 static int registered;
+static int aggregation_enabled;
 static dbipx_packet_callback rx_callback = NULL;
 struct ipx_address dbipx_local_addr;
+unsigned short dbipx_mtu = DBIPX_MAX_MTU;
 
 extern "C" {
 
@@ -40,41 +65,176 @@ void Error(char *fmt, ...)
 	exit(1);
 }
 
-static void PacketReceived(const unsigned char *packet, const UdpHeader *udp)
+static void ProcessIPXPacket(const struct ipx_header *ipx, unsigned int len)
 {
-	const struct ipx_header *ipx;
-	unsigned int len = ntohs(udp->len);
-
-	if (len < sizeof(struct ipx_header)) {
-		Buffer_free(packet);
-		return;
-	}
+	const unsigned char *ext;
+	unsigned int flags, mtu;
 
-	ipx = (const struct ipx_header *) (packet + sizeof(UdpPacket_t));
 	if (ntohs(ipx->src.socket) == 2 && ntohs(ipx->dest.socket) == 2) {
 		registered = 1;
 		memcpy(&dbipx_local_addr, &ipx->dest, sizeof(struct ipx_address));
+
+		// The reply may carry a trailer acknowledging the
+		// extensions we asked for in SendRegistration().
+		if (len >= sizeof(struct ipx_header) + 6) {
+			ext = (const unsigned char *) ipx
+			    + sizeof(struct ipx_header);
+			if (memcmp(ext, extension_magic, 4) == 0) {
+				flags = (ext[4] << 8) | ext[5];
+				aggregation_enabled =
+				    (flags & EXTENSION_FLAG_AGGREGATION) != 0;
+				if ((flags & EXTENSION_FLAG_LARGE_MTU) != 0
+				 && len >= sizeof(struct ipx_header) + 8) {
+					mtu = (ext[6] << 8) | ext[7];
+					if (mtu >= sizeof(struct ipx_header)
+					 && mtu <= DBIPX_MAX_MTU) {
+						dbipx_mtu =
+						    (unsigned short) mtu;
+					}
+				}
+			}
+		}
 	} else if (rx_callback != NULL) {
 		rx_callback(ipx, len);
 	}
+}
+
+static void PacketReceived(const unsigned char *packet, const UdpHeader *udp)
+{
+	const unsigned char *payload;
+	unsigned int len, pos, pktlen;
+
+	len = ntohs(udp->len) - sizeof(UdpHeader);
+	payload = packet + sizeof(UdpPacket_t);
+
+	if (registered && aggregation_enabled) {
+		// The server coalesces packets: every datagram is a
+		// concatenation of length-prefixed IPX packets.
+		pos = 0;
+		while (pos + 2 <= len) {
+			pktlen = (payload[pos] << 8) | payload[pos + 1];
+			pos += 2;
+			if (pktlen < sizeof(struct ipx_header)
+			 || pos + pktlen > len) {
+				break;
+			}
+			ProcessIPXPacket(
+			    (const struct ipx_header *) (payload + pos),
+			    pktlen);
+			pos += pktlen;
+		}
+	} else if (len >= sizeof(struct ipx_header)) {
+		ProcessIPXPacket((const struct ipx_header *) payload, len);
+	}
 
 	Buffer_free(packet);
 }
 
 static void SendRegistration(void)
 {
-	static struct ipx_header tmphdr;
-
-	memset(&tmphdr, 0, sizeof(tmphdr));
-	tmphdr.dest.socket = htons(2);
-	tmphdr.src.socket = htons(2);
-	tmphdr.checksum = htons(0xffff);
-	tmphdr.length = htons(0x1e);
-	tmphdr.transport_control = 0;
-	tmphdr.type = 0xff;
+	static struct registration_packet tmppkt;
+
+	memset(&tmppkt, 0, sizeof(tmppkt));
+	tmppkt.hdr.dest.socket = htons(2);
+	tmppkt.hdr.src.socket = htons(2);
+	tmppkt.hdr.checksum = htons(0xffff);
+	tmppkt.hdr.length = htons(0x1e);
+	tmppkt.hdr.transport_control = 0;
+	tmppkt.hdr.type = 0xff;
+	memcpy(tmppkt.magic, extension_magic, 4);
+	tmppkt.flags = htons(EXTENSION_FLAG_AGGREGATION
+	                   | EXTENSION_FLAG_LARGE_MTU);
+	tmppkt.mtu = htons(DBIPX_MAX_MTU);
 
 	Udp::sendUdp(server_addr, udp_port, udp_port,
-	             sizeof(tmphdr), (unsigned char *) &tmphdr, 0);
+	             sizeof(tmppkt), (unsigned char *) &tmppkt, 0);
+}
+
+// Received packets that arrive while no posted listen ECB can take them
+// are parked in a small staging ring instead of being dropped, and
+// handed over when the application next posts an ECB. This absorbs
+// short bursts above the posted-ECB count, where losing the packet
+// would cost a retransmit round trip.
+#define NUM_STAGED_PACKETS 4
+
+struct staged_packet {
+	unsigned short len;  // 0 = slot free
+	unsigned short age;  // stamp from staging_counter
+	unsigned char data[DBIPX_MAX_MTU];
+};
+
+static struct staged_packet staging_ring[NUM_STAGED_PACKETS];
+static unsigned short staging_counter;
+
+// AgeBefore returns nonzero if stamp a was taken before stamp b,
+// tolerating counter wraparound.
+static int AgeBefore(unsigned short a, unsigned short b)
+{
+	return (short) (a - b) < 0;
+}
+
+// DBIPX_StagePacket parks a copy of the given packet in the staging
+// ring. If the ring is full the oldest staged packet is overwritten;
+// a stale packet is the least useful one to keep.
+void DBIPX_StagePacket(const struct ipx_header *pkt, size_t len)
+{
+	struct staged_packet *slot, *p;
+	int i;
+
+	if (len > sizeof(slot->data)) {
+		return;
+	}
+
+	slot = NULL;
+	for (i = 0; i < NUM_STAGED_PACKETS; ++i) {
+		p = &staging_ring[i];
+		if (p->len == 0) {
+			slot = p;
+			break;
+		}
+		if (slot == NULL || AgeBefore(p->age, slot->age)) {
+			slot = p;
+		}
+	}
+
+	++staging_counter;
+	slot->len = (unsigned short) len;
+	slot->age = staging_counter;
+	memcpy(slot->data, pkt, len);
+}
+
+// DBIPX_ClaimStaged removes and returns the oldest staged packet for
+// the given socket (network byte order) that fits in max_len, or NULL.
+// The returned pointer is only valid until the next receive poll, so
+// the caller must consume the packet immediately.
+const struct ipx_header *DBIPX_ClaimStaged(unsigned short socket,
+                                           size_t max_len, size_t *len)
+{
+	struct staged_packet *best, *p;
+	const struct ipx_header *hdr;
+	int i;
+
+	best = NULL;
+	for (i = 0; i < NUM_STAGED_PACKETS; ++i) {
+		p = &staging_ring[i];
+		if (p->len == 0 || p->len > max_len) {
+			continue;
+		}
+		hdr = (const struct ipx_header *) p->data;
+		if (hdr->dest.socket != socket) {
+			continue;
+		}
+		if (best == NULL || AgeBefore(p->age, best->age)) {
+			best = p;
+		}
+	}
+
+	if (best == NULL) {
+		return NULL;
+	}
+	*len = best->len;
+	best->len = 0;
+	return (const struct ipx_header *) best->data;
 }
 
 static void Delay(int timer_ticks)
@@ -148,10 +308,50 @@ void DBIPX_Connect(const char *addr, int port)
 	}
 }
 
-void DBIPX_SendPacket(struct ipx_header *pkt, size_t len)
+// Transmit buffer for DBIPX_SendFragments, with room for the Ethernet,
+// IP and UDP headers ahead of the payload so that mTCP can send from it
+// in place (the "preAlloc" form of sendUdp) instead of copying the
+// assembled packet a second time into one of its own transmit buffers.
+static struct {
+	UdpPacket_t hdr;
+	unsigned char payload[DBIPX_MAX_MTU];
+} sendpkt;
+
+// Gather-send an IPX packet directly from an ECB fragment list. The
+// fragments contain the packet as the application built it; the first
+// sizeof(struct ipx_header) bytes of the fragment stream are replaced by
+// *hdr, which carries the header as patched by the driver. Each fragment
+// is copied exactly once, straight into the transmit buffer.
+void DBIPX_SendFragments(const struct ipx_header *hdr,
+                         const struct ipx_ecb_fragment far *fragments,
+                         unsigned int count, size_t len)
 {
+	unsigned char *dest = sendpkt.payload;
+	const unsigned char far *fragptr;
+	size_t skip, nbytes;
+	unsigned int i;
+
+	memcpy(dest, hdr, sizeof(struct ipx_header));
+	dest += sizeof(struct ipx_header);
+
+	skip = sizeof(struct ipx_header);
+	for (i = 0; i < count; ++i) {
+		fragptr = (const unsigned char far *)
+		    MK_FP(fragments[i].seg, fragments[i].off);
+		nbytes = fragments[i].size;
+		if (skip >= nbytes) {
+			skip -= nbytes;
+			continue;
+		}
+		fragptr += skip;
+		nbytes -= skip;
+		skip = 0;
+		_fmemcpy(dest, fragptr, nbytes);
+		dest += nbytes;
+	}
+
 	Udp::sendUdp(server_addr, udp_port, udp_port,
-	             len, (uint8_t *) pkt, 0);
+	             len, (uint8_t *) &sendpkt, 1);
 }
 
 void DBIPX_SetCallback(dbipx_packet_callback callback)
@@ -11,12 +11,20 @@ typedef void (*dbipx_packet_callback)(const struct ipx_header *pkt,
 
 void DBIPX_Connect(const char *addr, int port);
 void DBIPX_GetAddress(char *addr);
-void DBIPX_SendPacket(struct ipx_header *pkt, size_t len);
+void DBIPX_SendFragments(const struct ipx_header *hdr,
+                         const struct ipx_ecb_fragment far *fragments,
+                         unsigned int count, size_t len);
+void DBIPX_StagePacket(const struct ipx_header *pkt, size_t len);
+const struct ipx_header *DBIPX_ClaimStaged(unsigned short socket,
+                                           size_t max_len, size_t *len);
 void DBIPX_SetCallback(dbipx_packet_callback callback);
 void DBIPX_Poll(void);
 
 extern struct ipx_address dbipx_local_addr;
 
+// Maximum packet size negotiated with the server at registration time.
+extern unsigned short dbipx_mtu;
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,4 +1,5 @@
 
+#include <conio.h>
 #include <dos.h>
 #include <i86.h>
 #include <stdio.h>
@@ -13,8 +14,43 @@
 #define IPX_INTERRUPT         0x7a
 #define REDIRECTOR_INTERRUPT  0x2f
 
+// The BIOS timer ticks at 18.2Hz, so a packet sitting in the mTCP
+// buffer ring could wait up to 55ms before a poll picked it up. We
+// reprogram the PIT to tick TIMER_SPEEDUP times faster and poll on
+// every tick, chaining to the old handler only once every TIMER_SPEEDUP
+// ticks so that the BIOS clock (and anything else hooked below us)
+// still runs at exactly the standard rate. This only holds while we are
+// first in the INT 8 chain, so the ISR watches the vector and falls
+// back to the standard rate whenever something hooks above us.
+#define TIMER_SPEEDUP  64
+#define PIT_DIVISOR    (0x10000L / TIMER_SPEEDUP)
+
+// Consecutive latched channel 0 counts within PIT_DIVISOR required
+// before concluding a foreign INT 8 hooker left the PIT running at our
+// fast rate. A hooker running its own divisor shows a count above ours
+// almost immediately, since the count is sampled just after a reload.
+#define TIMER_OWNER_CHECKS  4
+
+// PIT and PIC I/O ports.
+#define PIT_COMMAND  0x43
+#define PIT_DATA_0   0x40
+#define PIC_COMMAND  0x20
+#define PIC_EOI      0x20
+
 #define MAX_OPEN_SOCKETS 8
 
+// Open sockets live in a small hash table indexed by socket number so
+// that the receive ISR finds the destination socket in constant time
+// instead of scanning the socket array per packet.
+#define SOCKET_HASH_SIZE 16
+
+// Pending listen ECBs are kept in per-socket lists bucketed by capacity
+// class. A packet's class is computed from its length; every ECB in a
+// higher bucket is guaranteed to fit it, and within the packet's own
+// bucket a single compare against the capacity cached at listen time
+// decides, so the ISR never walks fragment lists.
+#define NUM_ECB_BUCKETS 4
+
 #define IPX_CMD_OPEN_SOCKET   0x0000
 #define IPX_CMD_CLOSE_SOCKET  0x0001
 #define IPX_CMD_GET_LOCAL_TGT 0x0002
@@ -31,21 +67,43 @@
 #define IPX_CMD_SPX_INSTALLED 0x0010
 #define IPX_CMD_GET_MTU       0x001a
 
-#define MTU 1500
-
 struct ipx_socket {
 	unsigned short socket;
-	struct ipx_ecb far *ecbs;
+	struct ipx_socket *hash_next;
+	struct ipx_ecb far *ecbs[NUM_ECB_BUCKETS];
 };
 
-static uint8_t sendbuf[MTU];
+// Driver-private per-ECB state, stored in the driver_workspace field
+// that the IPX protocol reserves for us.
+struct ecb_workspace {
+	// Total capacity of the ECB's fragments, cached by ListenPacket.
+	unsigned short capacity;
+};
+
+#define ECB_WORKSPACE(ecb) \
+	((struct ecb_workspace far *) &(ecb)->driver_workspace)
+
 static void (__interrupt far *old_isr)(void);
 static void (__interrupt far *old_timer_isr)(void);
 static void (__interrupt far *next_redirector)(void);
 static struct ipx_socket open_sockets[MAX_OPEN_SOCKETS];
-static unsigned int num_open_sockets;
+static struct ipx_socket *socket_hash[SOCKET_HASH_SIZE];
 static unsigned int saved_ss, saved_sp;
 
+// Set while we are inside the driver, either servicing an IPX call or
+// polling mTCP; the timer tick skips its poll rather than reentering.
+static volatile unsigned char dbipx_busy;
+static unsigned int timer_ticks;
+
+// The INT 8 vector as we installed it, read back from the interrupt
+// vector table so the timer ISR can detect a later hooker with a single
+// dword compare. timer_foreign is set while one is present.
+#define TIMER_VECTOR_LIVE \
+	(*(unsigned long far *) MK_FP(0, TIMER_INTERRUPT * 4))
+static unsigned long our_timer_vec;
+static unsigned char timer_foreign;
+static unsigned char timer_probe;
+
 extern void SwitchStack(unsigned int);
 #pragma aux SwitchStack = \
 	"mov saved_ss, ss" \
@@ -60,23 +118,82 @@ extern void RestoreStack(void);
 	"mov ss, saved_ss" \
 	"mov sp, saved_sp";
 
-static unsigned char isr_stack_space[512];
+// Large enough for mTCP's processing plus a nested IPX call made from
+// an application's ESR callback.
+static unsigned char isr_stack_space[1024];
 #define SWITCH_ISR_STACK \
 	SwitchStack(FP_OFF(isr_stack_space + sizeof(isr_stack_space) - 32))
 
+// esr_vector holds the far address of the ESR about to be invoked, so
+// that the call below has a memory operand to call through.
+static unsigned short esr_vector[2];
+
+extern void CallESRAsm(unsigned short ecb_off, unsigned short ecb_seg);
+// The ESR may clobber any general register, including DS and BP, which
+// the compiler assumes survive; both are saved around the call so that
+// DGROUP accesses after the ESR returns stay valid.
+#pragma aux CallESRAsm = \
+	"pushf" \
+	"cli" \
+	"push ds" \
+	"push bp" \
+	"mov si, ax" \
+	"mov es, dx" \
+	"call dword ptr esr_vector" \
+	"pop bp" \
+	"pop ds" \
+	"popf" \
+	parm [ax] [dx] \
+	modify [ax bx cx dx si di es];
+
+// CallESR invokes the ECB's event service routine, if it has one, with
+// the documented conventions: interrupts disabled and ES:SI pointing at
+// the completed ECB. The ESR may itself invoke IPX services, so it must
+// only be called once our data structures are consistent.
+static void CallESR(struct ipx_ecb far *ecb)
+{
+	if (ecb->esr_address[0] == 0 && ecb->esr_address[1] == 0) {
+		return;
+	}
+	esr_vector[0] = ecb->esr_address[0];
+	esr_vector[1] = ecb->esr_address[1];
+	CallESRAsm(FP_OFF(ecb), FP_SEG(ecb));
+}
+
+static unsigned int SocketHash(unsigned short num)
+{
+	return (num ^ (num >> 8)) & (SOCKET_HASH_SIZE - 1);
+}
+
 static struct ipx_socket *FindSocket(unsigned short num)
 {
-	int i;
+	struct ipx_socket *sock;
 
-	for (i = 0; i < MAX_OPEN_SOCKETS; ++i) {
-		if (open_sockets[i].socket == num) {
-			return &open_sockets[i];
+	for (sock = socket_hash[SocketHash(num)]; sock != NULL;
+	     sock = sock->hash_next) {
+		if (sock->socket == num) {
+			return sock;
 		}
 	}
 
 	return NULL;
 }
 
+// BucketForSize returns the capacity class for the given packet length
+// or ECB capacity. Every ECB in a bucket above a packet's class is
+// guaranteed to have room for it.
+static unsigned int BucketForSize(size_t size)
+{
+	if (size >= 1024) {
+		return 3;
+	} else if (size >= 512) {
+		return 2;
+	} else if (size >= 128) {
+		return 1;
+	}
+	return 0;
+}
+
 static size_t ECBSize(struct ipx_ecb far *ecb)
 {
 	size_t result = 0;
@@ -92,15 +209,27 @@ static size_t ECBSize(struct ipx_ecb far *ecb)
 static struct ipx_ecb far * far *FindECB(struct ipx_socket *sock, size_t len)
 {
 	struct ipx_ecb far * far *ecb;
+	unsigned int b;
 
-	ecb = &sock->ecbs;
+	b = BucketForSize(len);
+
+	// Within the packet's own bucket an ECB may still be too small;
+	// the capacity cached at listen time decides with one compare.
+	ecb = &sock->ecbs[b];
 	while (*ecb != NULL) {
-		if (ECBSize(*ecb) >= len) {
+		if (ECB_WORKSPACE(*ecb)->capacity >= len) {
 			return ecb;
 		}
 		ecb = &(*ecb)->next_ecb;
 	}
 
+	// Anything in a higher bucket is guaranteed to fit.
+	for (++b; b < NUM_ECB_BUCKETS; ++b) {
+		if (sock->ecbs[b] != NULL) {
+			return &sock->ecbs[b];
+		}
+	}
+
 	return NULL;
 }
 
@@ -125,6 +254,7 @@ static void PacketReceived(const struct ipx_header *pkt, size_t len)
 {
 	struct ipx_socket *sock;
 	struct ipx_ecb far * far *ecb;
+	struct ipx_ecb far *found;
 
 	if (pkt->dest.socket == 0) {
 		return;
@@ -136,22 +266,29 @@ static void PacketReceived(const struct ipx_header *pkt, size_t len)
 	}
 	ecb = FindECB(sock, len);
 	if (ecb == NULL) {
+		// The socket is open but no posted ECB can take the
+		// packet; park it until the application posts one.
+		DBIPX_StagePacket(pkt, len);
 		return;
 	}
-	FillECB(*ecb, (const uint8_t *) pkt, len);
-
-	// Mark as delivered and unhook from linked list.
-	_fmemcpy(&(*ecb)->immediate_address, pkt->src.node, 6);
-	(*ecb)->in_use = 0;
-	(*ecb)->completion_code = 0;
-	// TODO: ESR notification
-	*ecb = (*ecb)->next_ecb;
+	found = *ecb;
+	FillECB(found, (const uint8_t *) pkt, len);
+
+	// Mark as delivered and unhook from linked list before invoking
+	// the ESR, which may immediately repost the ECB.
+	_fmemcpy(&found->immediate_address, pkt->src.node, 6);
+	found->in_use = 0;
+	found->completion_code = 0;
+	*ecb = found->next_ecb;
+	CallESR(found);
 }
 
 static void OpenSocket(union INTPACK far *ip)
 {
 	struct ipx_socket *sock;
+	unsigned int hash;
 	int socknum;
+	int i;
 
 	socknum = ntohs(ip->w.dx);
 
@@ -168,21 +305,32 @@ static void OpenSocket(union INTPACK far *ip)
 		return;
 	}
 
-	sock = FindSocket(0);
+	sock = NULL;
+	for (i = 0; i < MAX_OPEN_SOCKETS; ++i) {
+		if (open_sockets[i].socket == 0) {
+			sock = &open_sockets[i];
+			break;
+		}
+	}
 	if (sock == NULL) {
 		ip->w.ax = 0xfe;
 		return;
 	}
 
 	sock->socket = socknum;
-	sock->ecbs = NULL;
+	for (i = 0; i < NUM_ECB_BUCKETS; ++i) {
+		sock->ecbs[i] = NULL;
+	}
+	hash = SocketHash(socknum);
+	sock->hash_next = socket_hash[hash];
+	socket_hash[hash] = sock;
 	ip->w.ax = 0;
 	ip->w.dx = htons(socknum);
 }
 
 static void CloseSocket(unsigned int num)
 {
-	struct ipx_socket *sock;
+	struct ipx_socket *sock, **rover;
 
 	if (num == 0) {
 		return;
@@ -193,48 +341,68 @@ static void CloseSocket(unsigned int num)
 		return;
 	}
 
+	rover = &socket_hash[SocketHash(num)];
+	while (*rover != sock) {
+		rover = &(*rover)->hash_next;
+	}
+	*rover = sock->hash_next;
 	sock->socket = 0;
 }
 
-static int SendPacket(struct ipx_ecb far *ecb)
+// ExtractHeader copies the IPX header out of the start of the ECB's
+// fragment stream; the header may in principle span fragments.
+static void ExtractHeader(struct ipx_ecb far *ecb, struct ipx_header *hdr)
 {
-	struct ipx_header *pkt;
-	uint8_t far *fragptr;
-	int size;
+	uint8_t *dest = (uint8_t *) hdr;
+	size_t remaining = sizeof(struct ipx_header);
+	size_t nbytes;
 	int i;
 
-	size = 0;
-	for (i = 0; i < ecb->fragment_count; ++i) {
-		size += ecb->fragments[i].size;
+	for (i = 0; i < ecb->fragment_count && remaining > 0; ++i) {
+		nbytes = ecb->fragments[i].size;
+		if (nbytes > remaining) {
+			nbytes = remaining;
+		}
+		_fmemcpy(dest, MK_FP(ecb->fragments[i].seg,
+		                     ecb->fragments[i].off), nbytes);
+		dest += nbytes;
+		remaining -= nbytes;
 	}
+}
 
-	if (size > MTU) {
+static int SendPacket(struct ipx_ecb far *ecb)
+{
+	// Not reentrant, but neither is the ISR that calls us; static
+	// keeps it off the small ISR stack.
+	static struct ipx_header hdr;
+	size_t size;
+
+	size = ECBSize(ecb);
+	if (size > dbipx_mtu || size < sizeof(struct ipx_header)) {
 		ecb->in_use = 0;
 		ecb->completion_code = 0xff;
+		CallESR(ecb);
 		return 0xff;
 	}
 
-	size = 0;
-	for (i = 0; i < ecb->fragment_count; ++i) {
-		fragptr = MK_FP(ecb->fragments[i].seg, ecb->fragments[i].off);
-		_fmemcpy(&sendbuf[size], fragptr, ecb->fragments[i].size);
-		size += ecb->fragments[i].size;
-	}
-
-	pkt = (struct ipx_header *) sendbuf;
-	_fmemcpy(&pkt->src, &dbipx_local_addr, sizeof(struct ipx_address));
-	pkt->src.socket = ecb->socket;
-	pkt->length = ntohs(size);
+	// Patch our address into a copy of the header; the fragments
+	// themselves are handed to the gather-send path untouched, so the
+	// packet is copied once into the transmit buffer rather than
+	// being assembled here and copied again.
+	ExtractHeader(ecb, &hdr);
+	_fmemcpy(&hdr.src, &dbipx_local_addr, sizeof(struct ipx_address));
+	hdr.src.socket = ecb->socket;
+	hdr.length = ntohs((unsigned short) size);
 
 	// TODO: Copy back modified header into fragment
 
-	DBIPX_SendPacket(pkt, size);
+	DBIPX_SendFragments(&hdr, ecb->fragments, ecb->fragment_count, size);
 
 	// TODO: Loopback delivery and broadcast
 
 	ecb->in_use = 0;
 	ecb->completion_code = 0;
-	// TODO: ESR notification
+	CallESR(ecb);
 
 	return 0;
 }
@@ -242,15 +410,29 @@ static int SendPacket(struct ipx_ecb far *ecb)
 static int ListenPacket(struct ipx_ecb far *ecb)
 {
 	struct ipx_socket *sock = FindSocket(ntohs(ecb->socket));
+	const struct ipx_header *staged;
+	size_t capacity, staged_len;
+	unsigned int b;
 
 	if (sock == NULL) {
 		ecb->completion_code = 0xff;
 		return 0xff;
 	}
 
-	ecb->next_ecb = sock->ecbs;
-	sock->ecbs = ecb;
+	// Walk the fragments once here, so the ISR never has to.
+	capacity = ECBSize(ecb);
+	ECB_WORKSPACE(ecb)->capacity = (unsigned short) capacity;
+	b = BucketForSize(capacity);
+	ecb->next_ecb = sock->ecbs[b];
+	sock->ecbs[b] = ecb;
 	ecb->in_use = 1;
+
+	// A packet for this socket may have arrived while no ECB was
+	// posted; deliver it to the freshly posted ECB right away.
+	staged = DBIPX_ClaimStaged(ecb->socket, capacity, &staged_len);
+	if (staged != NULL) {
+		PacketReceived(staged, staged_len);
+	}
 	return 0;
 }
 
@@ -300,14 +482,14 @@ static void Real_IPX_ISR(union INTPACK far *ip)
 			// no-op
 			break;
 		case IPX_CMD_GET_PKT_SIZE:
-			ip->w.ax = 1024;
+			ip->w.ax = dbipx_mtu;
 			ip->w.cx = 0;
 			break;
 		case IPX_CMD_SPX_INSTALLED:
 			ip->w.ax = 0;
 			break;
 		case IPX_CMD_GET_MTU:
-			ip->w.ax = MTU;
+			ip->w.ax = dbipx_mtu;
 			ip->w.cx = 0;
 			break;
 		default:
@@ -318,11 +500,22 @@ static void Real_IPX_ISR(union INTPACK far *ip)
 static void __interrupt __far IPX_ISR(union INTPACK ip)
 {
 	static union INTPACK far *_ip;
+	unsigned char was_busy;
 	_ip = &ip;
 
-	SWITCH_ISR_STACK;
-	Real_IPX_ISR(_ip);
-	RestoreStack();
+	was_busy = dbipx_busy;
+	dbipx_busy = 1;
+	if (was_busy) {
+		// Reentered from an ESR callback: we are already running
+		// on the ISR stack and must not switch onto it again, or
+		// the outer invocation's saved stack would be lost.
+		Real_IPX_ISR(_ip);
+	} else {
+		SWITCH_ISR_STACK;
+		Real_IPX_ISR(_ip);
+		RestoreStack();
+	}
+	dbipx_busy = was_busy;
 }
 
 extern void IPXTrampolineASM();
@@ -353,13 +546,79 @@ static void __interrupt __far RedirectorISR(union INTPACK ip)
 	_chain_intr(next_redirector);
 }
 
+// SetTimerDivisor reprograms PIT channel 0 to the given divisor; zero
+// selects the full 65536 count, i.e. the standard 18.2Hz rate. Must be
+// called with interrupts disabled.
+static void SetTimerDivisor(unsigned int divisor)
+{
+	outp(PIT_COMMAND, 0x36);
+	outp(PIT_DATA_0, divisor & 0xff);
+	outp(PIT_DATA_0, (divisor >> 8) & 0xff);
+}
+
+// ReadTimerCount latches and reads the current PIT channel 0 count.
+// Must be called with interrupts disabled.
+static unsigned int ReadTimerCount(void)
+{
+	unsigned int count;
+
+	outp(PIT_COMMAND, 0x00);
+	count = inp(PIT_DATA_0);
+	count |= (unsigned int) inp(PIT_DATA_0) << 8;
+	return count;
+}
+
 static void __interrupt __far TimerISR(union INTPACK ip)
 {
-	SWITCH_ISR_STACK;
-	DBIPX_Poll();
-	RestoreStack();
+	if (!dbipx_busy) {
+		dbipx_busy = 1;
+		SWITCH_ISR_STACK;
+		DBIPX_Poll();
+		RestoreStack();
+		dbipx_busy = 0;
+	}
+
+	// A game or TSR loaded after us may hook INT 8 above us, in which
+	// case our 64:1 divider no longer belongs between it and the BIOS
+	// clock: while the vector is not ours we chain on every tick, and
+	// polling slows to the hooker's rate until it unhooks and the
+	// vector becomes ours again. Whether to also restore the standard
+	// divisor depends on who owns the PIT rate now. Many games program
+	// their own divisor after hooking, and forcing 18.2Hz would slow
+	// their music and tick timing for the whole session, so we only
+	// stand the PIT down after the latched count proves it is still
+	// running at our fast divisor: a count above PIT_DIVISOR can only
+	// come from a foreign divisor, and under one the count sampled
+	// here, just after a reload, is high almost every tick.
+	if (TIMER_VECTOR_LIVE != our_timer_vec) {
+		if (!timer_foreign) {
+			timer_foreign = 1;
+			timer_probe = TIMER_OWNER_CHECKS;
+		}
+		if (timer_probe > 0) {
+			if (ReadTimerCount() > (unsigned int) PIT_DIVISOR) {
+				timer_probe = 0;
+			} else if (--timer_probe == 0) {
+				SetTimerDivisor(0);
+			}
+		}
+		timer_ticks = 0;
+		_chain_intr(old_timer_isr);
+	}
+	if (timer_foreign) {
+		timer_foreign = 0;
+		SetTimerDivisor((unsigned int) PIT_DIVISOR);
+	}
+
+	++timer_ticks;
+	if (timer_ticks >= TIMER_SPEEDUP) {
+		timer_ticks = 0;
+		_chain_intr(old_timer_isr);
+	}
 
-	_chain_intr(old_timer_isr);
+	// On the ticks where we don't chain to the old handler we must
+	// acknowledge the interrupt ourselves.
+	outp(PIC_COMMAND, PIC_EOI);
 }
 
 static void UnhookVector(void)
@@ -368,6 +627,7 @@ static void UnhookVector(void)
 	DBIPX_SetCallback(NULL);
 	_dos_setvect(IPX_INTERRUPT, old_isr);
 	_dos_setvect(REDIRECTOR_INTERRUPT, next_redirector);
+	SetTimerDivisor(0);
 	_dos_setvect(TIMER_INTERRUPT, old_timer_isr);
 	_enable();
 }
@@ -381,6 +641,8 @@ void HookIPXVector(void)
 	_dos_setvect(REDIRECTOR_INTERRUPT, RedirectorISR);
 	old_timer_isr = _dos_getvect(TIMER_INTERRUPT);
 	_dos_setvect(TIMER_INTERRUPT, TimerISR);
+	our_timer_vec = TIMER_VECTOR_LIVE;
+	SetTimerDivisor((unsigned int) PIT_DIVISOR);
 	DBIPX_SetCallback(PacketReceived);
 	_enable();
 
@@ -40,9 +40,15 @@ var (
 
 	AddrNull      = Addr([6]byte{0x00, 0x00, 0x00, 0x00, 0x00, 0x00})
 	AddrBroadcast = Addr([6]byte{0xff, 0xff, 0xff, 0xff, 0xff, 0xff})
+)
+
+const (
+	// HeaderLength is the number of bytes in an encoded IPX header.
+	HeaderLength = 30
 
-	minHeaderLength        = 30
-	minHeaderAddressLength = 12
+	// HeaderAddrLength is the number of bytes in an encoded IPX
+	// header address.
+	HeaderAddrLength = 12
 )
 
 func (a Addr) Network() string {
@@ -55,33 +61,46 @@ func (a Addr) String() string {
 
 // UnmarshalBinary decodes an IPX header address from a slice of bytes.
 func (a *HeaderAddr) UnmarshalBinary(data []byte) error {
-	if len(data) < minHeaderAddressLength {
-		return fmt.Errorf("Header address too short to decode: %d < %d", len(data), minHeaderAddressLength)
+	if len(data) < HeaderAddrLength {
+		return fmt.Errorf("Header address too short to decode: %d < %d", len(data), HeaderAddrLength)
 	}
 	copy(a.Network[0:], data[0:4])
 	copy(a.Addr[0:], data[4:10])
-	a.Socket = uint16((data[10] << 8) | data[11])
+	a.Socket = (uint16(data[10]) << 8) | uint16(data[11])
+	return nil
+}
+
+// MarshalTo encodes an IPX header address into a slice of bytes, which
+// must be at least HeaderAddrLength bytes long. Unlike MarshalBinary it
+// performs no heap allocation.
+func (a *HeaderAddr) MarshalTo(data []byte) error {
+	if len(data) < HeaderAddrLength {
+		return fmt.Errorf("buffer too short to encode header address: %d < %d", len(data), HeaderAddrLength)
+	}
+	copy(data[0:4], a.Network[0:4])
+	copy(data[4:10], a.Addr[0:])
+	data[10] = byte(a.Socket >> 8)
+	data[11] = byte(a.Socket & 0xff)
 	return nil
 }
 
 // MarshalBinary populates a slice of bytes from an IPX header address.
 func (a *HeaderAddr) MarshalBinary() ([]byte, error) {
-	result := make([]byte, 12)
-	copy(result[0:4], a.Network[0:4])
-	copy(result[4:10], a.Addr[0:])
-	result[10] = byte(a.Socket >> 8)
-	result[11] = byte(a.Socket & 0xff)
+	result := make([]byte, HeaderAddrLength)
+	if err := a.MarshalTo(result); err != nil {
+		return nil, err
+	}
 	return result, nil
 }
 
 // UnmarshalBinary decodes an IPX header from a slice of bytes.
 func (h *Header) UnmarshalBinary(packet []byte) error {
-	if len(packet) < minHeaderLength {
-		return fmt.Errorf("IPX header too short to decode: %d < %d", len(packet), minHeaderLength)
+	if len(packet) < HeaderLength {
+		return fmt.Errorf("IPX header too short to decode: %d < %d", len(packet), HeaderLength)
 	}
 
-	h.Checksum = uint16((packet[0] << 8) | packet[1])
-	h.Length = uint16((packet[2] << 8) | packet[3])
+	h.Checksum = (uint16(packet[0]) << 8) | uint16(packet[1])
+	h.Length = (uint16(packet[2]) << 8) | uint16(packet[3])
 	h.TransControl = packet[4]
 	h.PacketType = packet[5]
 
@@ -91,29 +110,47 @@ func (h *Header) UnmarshalBinary(packet []byte) error {
 	return h.Src.UnmarshalBinary(packet[18:30])
 }
 
-// MarshalBinary populates a slice of bytes from an IPX header.
-func (h *Header) MarshalBinary() ([]byte, error) {
-	result := []byte{
-		byte(h.Checksum >> 8),
-		byte(h.Checksum & 0xff),
-		byte(h.Length >> 8),
-		byte(h.Length & 0xff),
-		h.TransControl,
-		h.PacketType,
+// MarshalTo encodes an IPX header into a slice of bytes, which must be
+// at least HeaderLength bytes long. Unlike MarshalBinary it performs no
+// heap allocation, so it is suitable for the packet hot path.
+func (h *Header) MarshalTo(packet []byte) error {
+	if len(packet) < HeaderLength {
+		return fmt.Errorf("buffer too short to encode IPX header: %d < %d", len(packet), HeaderLength)
 	}
-	dest, err := h.Dest.MarshalBinary()
-	if err != nil {
-		return nil, err
+	packet[0] = byte(h.Checksum >> 8)
+	packet[1] = byte(h.Checksum & 0xff)
+	packet[2] = byte(h.Length >> 8)
+	packet[3] = byte(h.Length & 0xff)
+	packet[4] = h.TransControl
+	packet[5] = h.PacketType
+	if err := h.Dest.MarshalTo(packet[6:18]); err != nil {
+		return err
 	}
-	src, err := h.Src.MarshalBinary()
-	if err != nil {
+	return h.Src.MarshalTo(packet[18:30])
+}
+
+// MarshalBinary populates a slice of bytes from an IPX header.
+func (h *Header) MarshalBinary() ([]byte, error) {
+	result := make([]byte, HeaderLength)
+	if err := h.MarshalTo(result); err != nil {
 		return nil, err
 	}
-	result = append(result, dest...)
-	result = append(result, src...)
 	return result, nil
 }
 
+// PeekAddresses extracts only the destination and source node addresses
+// from an encoded IPX packet. Forwarding only needs the addresses to
+// route a packet, and this is cheaper than decoding the full header.
+func PeekAddresses(packet []byte) (dest, src Addr, err error) {
+	if len(packet) < HeaderLength {
+		err = fmt.Errorf("IPX header too short to decode: %d < %d", len(packet), HeaderLength)
+		return
+	}
+	copy(dest[0:], packet[10:16])
+	copy(src[0:], packet[22:28])
+	return
+}
+
 func (h *Header) IsRegistrationPacket() bool {
 	return h.Dest.Socket == 2 && bytes.Equal(h.Dest.Addr[0:], AddrNull[:])
 }
@@ -0,0 +1,120 @@
+package ipx
+
+import (
+	"bytes"
+	"testing"
+)
+
+var testHeader = Header{
+	Checksum:     0xffff,
+	Length:       9999,
+	TransControl: 12,
+	PacketType:   34,
+	Dest: HeaderAddr{
+		Network: [4]byte{1, 2, 3, 4},
+		Addr:    Addr{5, 6, 7, 8, 9, 10},
+		Socket:  0x4567,
+	},
+	Src: HeaderAddr{
+		Network: [4]byte{0x43, 0x21, 0x87, 0x65},
+		Addr:    Addr{0x11, 0x22, 0x33, 0x44, 0x55, 0x66},
+		Socket:  0x2345,
+	},
+}
+
+func TestMarshalUnmarshalRoundTrip(t *testing.T) {
+	packet, err := testHeader.MarshalBinary()
+	if err != nil {
+		t.Fatalf("error marshalling header: %v", err)
+	}
+	if len(packet) != HeaderLength {
+		t.Errorf("wrong encoded length: want %d, got %d", HeaderLength, len(packet))
+	}
+	var got Header
+	if err := got.UnmarshalBinary(packet); err != nil {
+		t.Fatalf("error unmarshalling header: %v", err)
+	}
+	if got != testHeader {
+		t.Errorf("header did not survive round trip: want %+v, got %+v", testHeader, got)
+	}
+}
+
+func TestMarshalToMatchesMarshalBinary(t *testing.T) {
+	want, err := testHeader.MarshalBinary()
+	if err != nil {
+		t.Fatalf("error marshalling header: %v", err)
+	}
+	var buf [HeaderLength]byte
+	if err := testHeader.MarshalTo(buf[:]); err != nil {
+		t.Fatalf("error encoding header: %v", err)
+	}
+	if !bytes.Equal(want, buf[:]) {
+		t.Errorf("encodings differ: want %x, got %x", want, buf[:])
+	}
+}
+
+func TestPeekAddresses(t *testing.T) {
+	packet, err := testHeader.MarshalBinary()
+	if err != nil {
+		t.Fatalf("error marshalling header: %v", err)
+	}
+	dest, src, err := PeekAddresses(packet)
+	if err != nil {
+		t.Fatalf("error peeking addresses: %v", err)
+	}
+	if dest != testHeader.Dest.Addr {
+		t.Errorf("wrong dest address: want %v, got %v", testHeader.Dest.Addr, dest)
+	}
+	if src != testHeader.Src.Addr {
+		t.Errorf("wrong src address: want %v, got %v", testHeader.Src.Addr, src)
+	}
+}
+
+func TestUnmarshalTooShort(t *testing.T) {
+	var h Header
+	if err := h.UnmarshalBinary(make([]byte, HeaderLength-1)); err == nil {
+		t.Errorf("no error unmarshalling short packet")
+	}
+}
+
+func BenchmarkMarshalBinary(b *testing.B) {
+	for i := 0; i < b.N; i++ {
+		if _, err := testHeader.MarshalBinary(); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkMarshalTo(b *testing.B) {
+	var buf [HeaderLength]byte
+	for i := 0; i < b.N; i++ {
+		if err := testHeader.MarshalTo(buf[:]); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkUnmarshalBinary(b *testing.B) {
+	packet, err := testHeader.MarshalBinary()
+	if err != nil {
+		b.Fatal(err)
+	}
+	var h Header
+	for i := 0; i < b.N; i++ {
+		if err := h.UnmarshalBinary(packet); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkPeekAddresses(b *testing.B) {
+	packet, err := testHeader.MarshalBinary()
+	if err != nil {
+		b.Fatal(err)
+	}
+	for i := 0; i < b.N; i++ {
+		if _, _, err := PeekAddresses(packet); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
@@ -5,9 +5,17 @@ import (
 	"flag"
 	"fmt"
 	"log"
+	"os"
+	"os/signal"
+	"strconv"
+	"strings"
+	"sync"
+	"syscall"
 
 	"github.com/fragglet/ipxbox/bridge"
+	"github.com/fragglet/ipxbox/metrics"
 	"github.com/fragglet/ipxbox/phys"
+	"github.com/fragglet/ipxbox/pool"
 	"github.com/fragglet/ipxbox/server"
 	"github.com/fragglet/ipxbox/virtual"
 
@@ -23,14 +31,53 @@ var framers = map[string]phys.Framer{
 }
 
 var (
-	pcapDevice      = flag.String("pcap_device", "", `Send and receive packets to the given device ("list" to list all devices)`)
-	enableTap       = flag.Bool("enable_tap", false, "Bridge the server to a tap device.")
-	dumpPackets     = flag.Bool("dump_packets", false, "Dump packets to stdout.")
-	port            = flag.Int("port", 10000, "UDP port to listen on.")
-	clientTimeout   = flag.Duration("client_timeout", server.DefaultConfig.ClientTimeout, "Time of inactivity before disconnecting clients.")
-	ethernetFraming = flag.String("ethernet_framing", "802.2", `Framing to use when sending Ethernet packets. Valid values are "802.2", "802.3raw", "snap" and "eth-ii".`)
+	pcapDevice       = flag.String("pcap_device", "", `Send and receive packets to the given device ("list" to list all devices)`)
+	afpacketDevice   = flag.String("afpacket_device", "", "Send and receive packets on the given network interface using AF_PACKET memory-mapped rings; a lower-overhead alternative to -pcap_device (Linux only).")
+	enableTap        = flag.Bool("enable_tap", false, "Bridge the server to a tap device.")
+	dumpPackets      = flag.Bool("dump_packets", false, "Dump packets to stdout.")
+	port             = flag.Int("port", 10000, "UDP port to listen on.")
+	rooms            = flag.String("rooms", "", `Comma-separated list of additional name:port rooms to serve, eg. "doom:10001,quake:10002". Each room is an isolated network with its own broadcast domain; physical bridging only applies to the main network.`)
+	clientTimeout    = flag.Duration("client_timeout", server.DefaultConfig.ClientTimeout, "Time of inactivity before disconnecting clients.")
+	udpBatchSize     = flag.Int("udp_batch_size", server.DefaultConfig.BatchSize, "Maximum number of packets to read or write per system call; 1 disables batched I/O.")
+	shards           = flag.Int("shards", server.DefaultConfig.Shards, "Number of receive loops to run, each with its own SO_REUSEPORT socket; set to the number of cores to scale across them (Linux only).")
+	connectedSockets = flag.Bool("connected_sockets", false, "Give each client a UDP socket connected to its address, so sends use the kernel's cached route and received packets skip the client table lookup (Linux only).")
+	metricsAddr      = flag.String("metrics_addr", "", `If set, serve counters over HTTP on this address (eg. "localhost:8999") at /debug/vars.`)
+	bridgeTableSize  = flag.Int("bridge_table_size", bridge.TableSize, "Maximum number of IPX addresses the bridge learns per device.")
+	packetsPerSec    = flag.Int("client_packets_per_sec", 0, "Maximum packets per second accepted from each client; 0 means unlimited.")
+	bytesPerSec      = flag.Int("client_bytes_per_sec", 0, "Maximum bytes per second accepted from each client; 0 means unlimited.")
+	broadcastsPerSec = flag.Int("client_broadcasts_per_sec", 0, "Maximum broadcast packets per second accepted from each client; 0 means unlimited.")
+	ethernetFraming  = flag.String("ethernet_framing", "802.2", `Framing to use when sending Ethernet packets. Valid values are "802.2", "802.3raw", "snap" and "eth-ii".`)
+	maxPacketSize    = flag.Int("mtu", pool.DefaultBufferSize, "Largest IPX packet the server will carry. Clients can negotiate packet sizes up to this limit at registration; sizes above 1500 only make sense on LANs that carry jumbo UDP datagrams.")
+	stateFile        = flag.String("state_file", "", `If set, save the client table to this file on SIGINT/SIGTERM and restore it at startup, so that clients survive a server restart without re-registering. Extra rooms use "<file>.<room>".`)
 )
 
+// room is an independent network served on its own UDP port. Clients in
+// different rooms cannot see each other, so broadcast fan-out scales
+// with the size of the room rather than the whole server, and each
+// room's switch runs without contending with the others.
+type room struct {
+	name string
+	port int
+	net  *virtual.Network
+}
+
+// parseRooms parses a comma-separated list of name:port entries.
+func parseRooms(spec string) ([]room, error) {
+	result := []room{}
+	for _, entry := range strings.Split(spec, ",") {
+		sep := strings.LastIndex(entry, ":")
+		if sep < 1 {
+			return nil, fmt.Errorf("malformed room %q, want name:port", entry)
+		}
+		roomPort, err := strconv.Atoi(entry[sep+1:])
+		if err != nil {
+			return nil, fmt.Errorf("malformed room port in %q: %v", entry, err)
+		}
+		result = append(result, room{name: entry[0:sep], port: roomPort})
+	}
+	return result, nil
+}
+
 func printPackets(v *virtual.Network) {
 	tap := v.Tap()
 	defer tap.Close()
@@ -54,6 +101,12 @@ func printPackets(v *virtual.Network) {
 func main() {
 	flag.Parse()
 
+	bridge.TableSize = *bridgeTableSize
+	if *maxPacketSize < pool.DefaultBufferSize {
+		log.Fatalf("-mtu must be at least %d", pool.DefaultBufferSize)
+	}
+	pool.BufferSize = *maxPacketSize
+
 	framer, ok := framers[*ethernetFraming]
 	if !ok {
 		log.Fatalf("invalid Ethernet framing %q", *ethernetFraming)
@@ -62,7 +115,27 @@ func main() {
 	var cfg server.Config
 	cfg = *server.DefaultConfig
 	cfg.ClientTimeout = *clientTimeout
-	v := virtual.New()
+	cfg.BatchSize = *udpBatchSize
+	cfg.Shards = *shards
+	cfg.ConnectedSockets = *connectedSockets
+	cfg.MaxPacketsPerSec = *packetsPerSec
+	cfg.MaxBytesPerSec = *bytesPerSec
+	cfg.MaxBroadcastsPerSec = *broadcastsPerSec
+
+	allRooms := []room{{name: "main", port: *port}}
+	if *rooms != "" {
+		extraRooms, err := parseRooms(*rooms)
+		if err != nil {
+			log.Fatal(err)
+		}
+		allRooms = append(allRooms, extraRooms...)
+	}
+	for i := range allRooms {
+		allRooms[i].net = virtual.New()
+	}
+
+	// Physical bridging and packet dumping attach to the main network.
+	v := allRooms[0].net
 	if *enableTap {
 		p, err := phys.New(water.Config{})
 		if err != nil {
@@ -70,6 +143,13 @@ func main() {
 		}
 		tap := v.Tap()
 		go bridge.Run(tap, tap, p, p)
+	} else if *afpacketDevice != "" {
+		p, err := phys.NewAFPacket(*afpacketDevice, framer)
+		if err != nil {
+			log.Fatalf("failed to open AF_PACKET rings: %v", err)
+		}
+		tap := v.Tap()
+		go bridge.Run(tap, tap, p, p)
 	} else if *pcapDevice != "" {
 		// TODO: List
 		handle, err := pcap.OpenLive(*pcapDevice, 1500, true, pcap.BlockForever)
@@ -86,10 +166,78 @@ func main() {
 	if *dumpPackets {
 		go printPackets(v)
 	}
+	if *metricsAddr != "" {
+		go func() {
+			if err := metrics.ListenAndServe(*metricsAddr); err != nil {
+				log.Fatalf("failed to serve metrics: %v", err)
+			}
+		}()
+	}
+
+	var wg sync.WaitGroup
+	servers := make([]*server.Server, len(allRooms))
+	for i, r := range allRooms {
+		s, err := server.New(fmt.Sprintf(":%d", r.port), r.net, &cfg)
+		if err != nil {
+			log.Fatalf("failed to start room %q: %v", r.name, err)
+		}
+		if *stateFile != "" {
+			restoreState(s, statePath(r.name))
+		}
+		servers[i] = s
+		wg.Add(1)
+		go func() {
+			s.Run()
+			wg.Done()
+		}()
+	}
+	if *stateFile != "" {
+		go saveStateOnShutdown(servers, allRooms)
+	}
+	wg.Wait()
+}
+
+// statePath returns the snapshot file path for the named room.
+func statePath(name string) string {
+	if name == "main" {
+		return *stateFile
+	}
+	return *stateFile + "." + name
+}
 
-	s, err := server.New(fmt.Sprintf(":%d", *port), v, &cfg)
+// restoreState rebuilds a server's client table from the given snapshot
+// file, if one exists. The file is consumed so that a stale snapshot is
+// never applied twice.
+func restoreState(s *server.Server, path string) {
+	f, err := os.Open(path)
 	if err != nil {
-		log.Fatal(err)
+		return
+	}
+	err = s.RestoreState(f)
+	f.Close()
+	os.Remove(path)
+	if err != nil {
+		log.Printf("failed to restore client state from %q: %v", path, err)
+	}
+}
+
+// saveStateOnShutdown snapshots every server's client table when the
+// process is told to terminate, so that the next process can pick the
+// clients up where this one left off.
+func saveStateOnShutdown(servers []*server.Server, allRooms []room) {
+	sig := make(chan os.Signal, 1)
+	signal.Notify(sig, os.Interrupt, syscall.SIGTERM)
+	<-sig
+	for i, r := range allRooms {
+		path := statePath(r.name)
+		f, err := os.Create(path)
+		if err == nil {
+			err = servers[i].SaveState(f)
+			f.Close()
+		}
+		if err != nil {
+			log.Printf("failed to save client state to %q: %v", path, err)
+		}
 	}
-	s.Run()
+	os.Exit(0)
 }
@@ -0,0 +1,186 @@
+// Package main implements a load generator for exercising a DOSbox-IPX
+// server. It registers two clients with the server, blasts packets from
+// one to the other at a configurable size and rate, and reports the
+// achieved throughput and round-trip (client to client via the server)
+// latency percentiles.
+package main
+
+import (
+	"encoding/binary"
+	"flag"
+	"fmt"
+	"log"
+	"net"
+	"sort"
+	"time"
+
+	"github.com/fragglet/ipxbox/ipx"
+)
+
+var (
+	address    = flag.String("address", "localhost:10000", "Address of the server to test.")
+	packetSize = flag.Int("packet_size", 512, "Size of each packet in bytes, including the IPX header.")
+	rate       = flag.Int("rate", 10000, "Packets to send per second; 0 sends as fast as possible.")
+	duration   = flag.Duration("duration", 10*time.Second, "How long to send for.")
+)
+
+// register performs the registration handshake on the given socket and
+// returns the IPX address the server assigned.
+func register(socket *net.UDPConn) (ipx.Addr, error) {
+	request := &ipx.Header{
+		Checksum: 0xffff,
+		Length:   ipx.HeaderLength,
+		Dest:     ipx.HeaderAddr{Socket: 2},
+		Src:      ipx.HeaderAddr{Socket: 2},
+	}
+	var encoded [ipx.HeaderLength]byte
+	if err := request.MarshalTo(encoded[:]); err != nil {
+		return ipx.AddrNull, err
+	}
+	var buf [1500]byte
+	for attempt := 0; attempt < 5; attempt++ {
+		if _, err := socket.Write(encoded[:]); err != nil {
+			return ipx.AddrNull, err
+		}
+		socket.SetReadDeadline(time.Now().Add(time.Second))
+		n, err := socket.Read(buf[:])
+		if err != nil {
+			if nerr, ok := err.(net.Error); ok && nerr.Timeout() {
+				continue
+			}
+			return ipx.AddrNull, err
+		}
+		var reply ipx.Header
+		if err := reply.UnmarshalBinary(buf[0:n]); err != nil {
+			continue
+		}
+		// The assigned address is in the destination field of the reply.
+		return reply.Dest.Addr, nil
+	}
+	return ipx.AddrNull, fmt.Errorf("no registration reply from %v", *address)
+}
+
+// receiver reads packets from the socket until the deadline, recording the
+// one-way trip time stamped into each payload, and sends the latency
+// samples and received byte count back on the given channels.
+func receiver(socket *net.UDPConn, deadline time.Time, latencies chan<- []time.Duration, received chan<- int) {
+	samples := []time.Duration{}
+	totalBytes := 0
+	var buf [1500]byte
+	socket.SetReadDeadline(deadline.Add(100 * time.Millisecond))
+	for {
+		n, err := socket.Read(buf[:])
+		if err != nil {
+			break
+		}
+		if n < ipx.HeaderLength+8 {
+			continue
+		}
+		sentNanos := int64(binary.BigEndian.Uint64(buf[ipx.HeaderLength : ipx.HeaderLength+8]))
+		samples = append(samples, time.Duration(time.Now().UnixNano()-sentNanos))
+		totalBytes += n
+	}
+	latencies <- samples
+	received <- totalBytes
+}
+
+// percentile returns the given percentile from a sorted slice of samples.
+func percentile(sorted []time.Duration, p float64) time.Duration {
+	if len(sorted) == 0 {
+		return 0
+	}
+	index := int(float64(len(sorted)-1) * p / 100)
+	return sorted[index]
+}
+
+func main() {
+	flag.Parse()
+
+	serverAddr, err := net.ResolveUDPAddr("udp4", *address)
+	if err != nil {
+		log.Fatalf("failed to resolve server address: %v", err)
+	}
+	if *packetSize < ipx.HeaderLength+8 || *packetSize > 1500 {
+		log.Fatalf("packet size must be in the range %d - 1500", ipx.HeaderLength+8)
+	}
+
+	sender, err := net.DialUDP("udp4", nil, serverAddr)
+	if err != nil {
+		log.Fatalf("failed to open sender socket: %v", err)
+	}
+	sink, err := net.DialUDP("udp4", nil, serverAddr)
+	if err != nil {
+		log.Fatalf("failed to open sink socket: %v", err)
+	}
+
+	srcAddr, err := register(sender)
+	if err != nil {
+		log.Fatalf("failed to register sender: %v", err)
+	}
+	destAddr, err := register(sink)
+	if err != nil {
+		log.Fatalf("failed to register sink: %v", err)
+	}
+	fmt.Printf("registered clients %v -> %v\n", srcAddr, destAddr)
+
+	header := &ipx.Header{
+		Length: uint16(*packetSize),
+		Dest:   ipx.HeaderAddr{Addr: destAddr, Socket: 0x5000},
+		Src:    ipx.HeaderAddr{Addr: srcAddr, Socket: 0x5000},
+	}
+	packet := make([]byte, *packetSize)
+	if err := header.MarshalTo(packet); err != nil {
+		log.Fatalf("failed to encode header: %v", err)
+	}
+
+	startTime := time.Now()
+	deadline := startTime.Add(*duration)
+	latencies := make(chan []time.Duration, 1)
+	received := make(chan int, 1)
+	go receiver(sink, deadline, latencies, received)
+
+	var interval time.Duration
+	if *rate > 0 {
+		interval = time.Second / time.Duration(*rate)
+	}
+	sentPackets := 0
+	for time.Now().Before(deadline) {
+		// Each packet carries the time it was sent so that the
+		// receiver can compute the trip time through the server.
+		binary.BigEndian.PutUint64(packet[ipx.HeaderLength:],
+			uint64(time.Now().UnixNano()))
+		if _, err := sender.Write(packet); err != nil {
+			log.Fatalf("failed to send packet: %v", err)
+		}
+		sentPackets++
+		if interval > 0 {
+			// Pace against the target schedule rather than
+			// sleeping a fixed interval, so that timer
+			// granularity does not limit the rate.
+			nextSend := startTime.Add(time.Duration(sentPackets) * interval)
+			if sleep := time.Until(nextSend); sleep > 0 {
+				time.Sleep(sleep)
+			}
+		}
+	}
+	elapsed := time.Since(startTime)
+
+	samples := <-latencies
+	receivedBytes := <-received
+	sort.Slice(samples, func(i, j int) bool { return samples[i] < samples[j] })
+
+	lost := sentPackets - len(samples)
+	fmt.Printf("sent:       %d packets in %v (%.0f packets/sec)\n",
+		sentPackets, elapsed.Round(time.Millisecond),
+		float64(sentPackets)/elapsed.Seconds())
+	fmt.Printf("received:   %d packets, %d bytes (%.2f Mbit/sec)\n",
+		len(samples), receivedBytes,
+		float64(receivedBytes)*8/1e6/elapsed.Seconds())
+	fmt.Printf("lost:       %d packets (%.2f%%)\n",
+		lost, float64(lost)*100/float64(sentPackets))
+	if len(samples) > 0 {
+		fmt.Printf("latency:    p50=%v p90=%v p99=%v max=%v\n",
+			percentile(samples, 50), percentile(samples, 90),
+			percentile(samples, 99), samples[len(samples)-1])
+	}
+}
@@ -0,0 +1,126 @@
+// Package metrics provides cheap counters for instrumenting the packet
+// hot path, published through the standard expvar interface. Counters
+// are plain atomics, so incrementing one adds no locking or contention
+// to the code being measured. The values are exposed over an opt-in
+// HTTP listener at /debug/vars.
+package metrics
+
+import (
+	"expvar" // importing this registers the /debug/vars handler
+	"fmt"
+	"net/http"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+// Counter is a monotonically increasing atomic counter.
+type Counter struct {
+	value uint64
+}
+
+// NewCounter creates and publishes a counter with the given name.
+func NewCounter(name string) *Counter {
+	c := &Counter{}
+	expvar.Publish(name, c)
+	return c
+}
+
+// Add increments the counter by n.
+func (c *Counter) Add(n uint64) {
+	atomic.AddUint64(&c.value, n)
+}
+
+// Value returns the current value of the counter.
+func (c *Counter) Value() uint64 {
+	return atomic.LoadUint64(&c.value)
+}
+
+// String implements the expvar.Var interface.
+func (c *Counter) String() string {
+	return fmt.Sprintf("%d", c.Value())
+}
+
+// Gauge is an atomic value that can go up and down, eg. a queue depth.
+type Gauge struct {
+	value int64
+}
+
+// NewGauge creates and publishes a gauge with the given name.
+func NewGauge(name string) *Gauge {
+	g := &Gauge{}
+	expvar.Publish(name, g)
+	return g
+}
+
+// Add adjusts the gauge by n, which may be negative.
+func (g *Gauge) Add(n int64) {
+	atomic.AddInt64(&g.value, n)
+}
+
+// Value returns the current value of the gauge.
+func (g *Gauge) Value() int64 {
+	return atomic.LoadInt64(&g.value)
+}
+
+// String implements the expvar.Var interface.
+func (g *Gauge) String() string {
+	return fmt.Sprintf("%d", g.Value())
+}
+
+// Number of histogram buckets; bucket i counts observations of less
+// than 2^i microseconds, with the last bucket catching everything else.
+const histogramBuckets = 16
+
+// Histogram is a histogram of durations in exponential buckets, used
+// for things like forwarding latency. Observations are a single atomic
+// increment.
+type Histogram struct {
+	buckets [histogramBuckets]uint64
+}
+
+// NewHistogram creates and publishes a histogram with the given name.
+func NewHistogram(name string) *Histogram {
+	h := &Histogram{}
+	expvar.Publish(name, h)
+	return h
+}
+
+// Observe records a single duration.
+func (h *Histogram) Observe(d time.Duration) {
+	us := d.Microseconds()
+	bucket := 0
+	for us > 0 && bucket < histogramBuckets-1 {
+		us >>= 1
+		bucket++
+	}
+	atomic.AddUint64(&h.buckets[bucket], 1)
+}
+
+// String implements the expvar.Var interface, rendering the buckets as
+// a JSON object keyed by upper bound in microseconds.
+func (h *Histogram) String() string {
+	var sb strings.Builder
+	sb.WriteString("{")
+	for i := range h.buckets {
+		if i > 0 {
+			sb.WriteString(",")
+		}
+		if i < histogramBuckets-1 {
+			fmt.Fprintf(&sb, "\"le_%dus\": %d", 1<<uint(i),
+				atomic.LoadUint64(&h.buckets[i]))
+		} else {
+			fmt.Fprintf(&sb, "\"inf\": %d",
+				atomic.LoadUint64(&h.buckets[i]))
+		}
+	}
+	sb.WriteString("}")
+	return sb.String()
+}
+
+// ListenAndServe serves the metrics over HTTP on the given address; the
+// values can be read from /debug/vars. It blocks, so it is usually run
+// in its own goroutine.
+func ListenAndServe(addr string) error {
+	return http.ListenAndServe(addr, nil)
+}
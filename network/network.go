@@ -5,6 +5,7 @@ import (
 	"io"
 
 	"github.com/fragglet/ipxbox/ipx"
+	"github.com/fragglet/ipxbox/pool"
 )
 
 // Network represents the concept of an IPX network.
@@ -20,3 +21,37 @@ type Node interface {
 	// Address returns the IPX address of the node.
 	Address() ipx.Addr
 }
+
+// NodeRestorer is an optional interface implemented by networks whose
+// nodes can be re-created with a specific address, used to restore
+// state saved across a server restart.
+type NodeRestorer interface {
+	// NewNodeWithAddress creates a new node with the given address,
+	// returning an error if the address is already in use.
+	NewNodeWithAddress(addr ipx.Addr) (Node, error)
+}
+
+// PacketReader is an optional interface implemented by nodes that can
+// hand over received packets as pooled buffers. Ownership of the buffer
+// passes to the caller, which must Release() it, so delivery avoids the
+// copy that Read() into a caller-provided slice would make.
+type PacketReader interface {
+	ReadPacket() (*pool.Buffer, error)
+}
+
+// QueuedReader is an optional interface implemented by nodes that can be
+// consumed in an event-driven way, so that a consumer servicing many
+// nodes does not need a goroutine blocked in Read() for each of them.
+type QueuedReader interface {
+	// TryReadPacket returns the next packet queued for the node as a
+	// pooled buffer, without blocking; ownership passes to the
+	// caller. A nil buffer is returned if no packet is queued, and
+	// io.EOF once the node has been closed.
+	TryReadPacket() (*pool.Buffer, error)
+
+	// SetReadNotify registers a function to be invoked whenever a
+	// packet is delivered to the node's previously-empty queue. The
+	// function is called from the delivering goroutine and must not
+	// block.
+	SetReadNotify(notify func())
+}
@@ -0,0 +1,19 @@
+//go:build !linux
+// +build !linux
+
+package phys
+
+import (
+	"errors"
+	"io"
+)
+
+// AFPacketPhys is only supported on Linux, which is the only platform
+// with AF_PACKET sockets and TPACKET_V3 memory-mapped rings.
+type AFPacketPhys struct {
+	io.ReadWriteCloser
+}
+
+func NewAFPacket(ifaceName string, framer Framer) (*AFPacketPhys, error) {
+	return nil, errors.New("AF_PACKET rings not supported on this platform")
+}
@@ -1,176 +1,76 @@
 package phys
 
 import (
-	"net"
+	"fmt"
 
 	"github.com/fragglet/ipxbox/ipx"
-	"github.com/google/gopacket"
-	"github.com/google/gopacket/layers"
 )
 
-type Framer interface {
-	Frame(dest net.HardwareAddr, packet []byte) ([]gopacket.SerializableLayer, error)
-}
-
 const (
-	etherTypeIPX = layers.EthernetType(0x8137)
+	etherTypeIPX = 0x8137
 
 	lsapNovell = 0xe0
 	lsapSNAP   = 0xaa
 )
 
-var (
-	Framer802_2      = framer802_2{}
-	Framer802_3Raw   = framer802_3Raw{}
-	FramerSNAP       = framerSNAP{}
-	FramerEthernetII = framerEthernetII{}
-)
-
-// GetIPXPayload parses the layers in the given packet to locate and extract
-// an IPX payload.
-func GetIPXPayload(pkt gopacket.Packet) ([]byte, bool) {
-	var (
-		eth        *layers.Ethernet
-		nextLayers []gopacket.Layer
-	)
-	ls := pkt.Layers()
-	for idx, l := range ls {
-		var ok bool
-		eth, ok = l.(*layers.Ethernet)
-		if ok {
-			nextLayers = ls[idx+1:]
-			break
-		}
-	}
-
-	if eth == nil {
-		return nil, false
-	}
-	switch eth.EthernetType {
-	case etherTypeIPX:
-		// ETHERNET_II framing type.
-		return eth.LayerPayload(), true
-	case layers.EthernetTypeLLC:
-		break
-	default:
-		return nil, false
-	}
-
-	if len(nextLayers) < 1 {
-		return nil, false
-	}
-	llc, ok := nextLayers[0].(*layers.LLC)
-	if !ok {
-		return nil, false
-	}
-	llcBytes := llc.LayerContents()
-	switch {
-	case llc.DSAP == lsapNovell && llc.SSAP == lsapNovell:
-		// 802.2 framing type.
-		// https://en.wikipedia.org/wiki/IEEE_802.2
-		return llc.LayerPayload(), true
-	case llc.DSAP == lsapSNAP && llc.SSAP == lsapSNAP:
-		// SNAP header.
-		if len(nextLayers) < 2 {
-			return nil, false
-		}
-		snap, ok := nextLayers[1].(*layers.SNAP)
-		if !ok || snap.Type != etherTypeIPX {
-			return nil, false
-		}
-		return snap.LayerPayload(), true
-	case llcBytes[0] == 0xff && llcBytes[1] == 0xff:
-		// Novell "raw" 802.3:
-		// https://en.wikipedia.org/wiki/Ethernet_frame#Novell_raw_IEEE_802.3
-		// "This does not conform to the IEEE 802.3 standard, but
-		// since IPX always has FF as the first two octets" it can be
-		// interpreted correctly.
-		return eth.LayerPayload(), true
-	default:
-		return nil, false
-	}
+// Framer encodes IPX packets into Ethernet frames of a particular
+// framing type. The bytes between the Ethernet header and the payload
+// are constant per framing type, so they are kept as a precomputed
+// template that is copied in front of the payload; framing a packet is
+// two memcpys and no allocations.
+type Framer struct {
+	// template contains the constant framing bytes that sit between
+	// the Ethernet header and the IPX payload.
+	template []byte
+
+	// etherType is the value for the EtherType field; if zero, this
+	// is an 802.3 framing and the field instead holds the length of
+	// the template plus payload.
+	etherType uint16
 }
 
-type framer802_2 struct{}
-
-func (framer802_2) Frame(dest net.HardwareAddr, packet []byte) ([]gopacket.SerializableLayer, error) {
-	hdr := &ipx.Header{}
-	if err := hdr.UnmarshalBinary(packet); err != nil {
-		return nil, err
-	}
-	return []gopacket.SerializableLayer{
-		&layers.Ethernet{
-			SrcMAC:       net.HardwareAddr(hdr.Src.Addr[:]),
-			DstMAC:       dest,
-			EthernetType: layers.EthernetTypeLLC,
-			Length:       uint16(len(packet) + 3),
-		},
-		&layers.LLC{
-			DSAP:    lsapNovell,
-			SSAP:    lsapNovell,
-			Control: 3,
-		},
-		gopacket.Payload(packet),
-	}, nil
-}
-
-type framer802_3Raw struct{}
+var (
+	// Framer802_2 is the standard 802.2 framing type.
+	// https://en.wikipedia.org/wiki/IEEE_802.2
+	Framer802_2 = Framer{template: []byte{lsapNovell, lsapNovell, 3}}
+
+	// Framer802_3Raw is the Novell "raw" 802.3 framing type.
+	// https://en.wikipedia.org/wiki/Ethernet_frame#Novell_raw_IEEE_802.3
+	Framer802_3Raw = Framer{}
+
+	// FramerSNAP is 802.2 framing with a SNAP header.
+	FramerSNAP = Framer{template: []byte{
+		lsapSNAP, lsapSNAP, 3, 0, 0, 0,
+		etherTypeIPX >> 8, etherTypeIPX & 0xff,
+	}}
+
+	// FramerEthernetII is the DIX Ethernet II framing type.
+	FramerEthernetII = Framer{etherType: etherTypeIPX}
+)
 
-func (framer802_3Raw) Frame(dest net.HardwareAddr, packet []byte) ([]gopacket.SerializableLayer, error) {
-	hdr := &ipx.Header{}
-	if err := hdr.UnmarshalBinary(packet); err != nil {
-		return nil, err
+// EncodeFrame writes an Ethernet frame containing the given IPX packet
+// as payload into the given buffer, returning the encoded length. The
+// destination and source MAC addresses are taken from the addresses in
+// the IPX header.
+func (f *Framer) EncodeFrame(frame []byte, packet []byte) (int, error) {
+	dest, src, err := ipx.PeekAddresses(packet)
+	if err != nil {
+		return 0, err
 	}
-	return []gopacket.SerializableLayer{
-		&layers.Ethernet{
-			SrcMAC: net.HardwareAddr(hdr.Src.Addr[:]),
-			DstMAC: dest,
-			Length: uint16(len(packet)),
-		},
-		gopacket.Payload(packet),
-	}, nil
-}
-
-type framerSNAP struct{}
-
-func (framerSNAP) Frame(dest net.HardwareAddr, packet []byte) ([]gopacket.SerializableLayer, error) {
-	hdr := &ipx.Header{}
-	if err := hdr.UnmarshalBinary(packet); err != nil {
-		return nil, err
+	frameLen := ethHeaderLength + len(f.template) + len(packet)
+	if len(frame) < frameLen {
+		return 0, fmt.Errorf("buffer too short to encode frame: %d < %d", len(frame), frameLen)
 	}
-	return []gopacket.SerializableLayer{
-		&layers.Ethernet{
-			SrcMAC:       net.HardwareAddr(hdr.Src.Addr[:]),
-			DstMAC:       dest,
-			EthernetType: layers.EthernetTypeLLC,
-			Length:       uint16(len(packet) + 8),
-		},
-		&layers.LLC{
-			DSAP:    lsapSNAP,
-			SSAP:    lsapSNAP,
-			Control: 3,
-		},
-		&layers.SNAP{
-			Type:               etherTypeIPX,
-			OrganizationalCode: []byte{0, 0, 0},
-		},
-		gopacket.Payload(packet),
-	}, nil
-}
-
-type framerEthernetII struct{}
-
-func (framerEthernetII) Frame(dest net.HardwareAddr, packet []byte) ([]gopacket.SerializableLayer, error) {
-	hdr := &ipx.Header{}
-	if err := hdr.UnmarshalBinary(packet); err != nil {
-		return nil, err
+	copy(frame[0:6], dest[:])
+	copy(frame[6:12], src[:])
+	etherType := f.etherType
+	if etherType == 0 {
+		// 802.3 framing; the field holds the payload length.
+		etherType = uint16(len(f.template) + len(packet))
 	}
-	return []gopacket.SerializableLayer{
-		&layers.Ethernet{
-			SrcMAC:       net.HardwareAddr(hdr.Src.Addr[:]),
-			DstMAC:       dest,
-			EthernetType: etherTypeIPX,
-		},
-		gopacket.Payload(packet),
-	}, nil
+	frame[12] = byte(etherType >> 8)
+	frame[13] = byte(etherType & 0xff)
+	copy(frame[ethHeaderLength:], f.template)
+	copy(frame[ethHeaderLength+len(f.template):], packet)
+	return frameLen, nil
 }
@@ -0,0 +1,64 @@
+package phys
+
+// Byte offsets into a raw Ethernet frame: destination and source MAC
+// addresses followed by a 16-bit EtherType (or, for 802.3, length)
+// field.
+const (
+	ethHeaderLength  = 14
+	llcHeaderLength  = 3
+	snapHeaderLength = 5
+)
+
+// GetIPXPayload locates the IPX payload inside a raw Ethernet frame,
+// identifying the framing type by inspecting byte offsets directly. The
+// returned slice points into the frame itself, so nothing is allocated
+// or copied; the caller must finish with it before the next read
+// overwrites the capture buffer.
+func GetIPXPayload(frame []byte) ([]byte, bool) {
+	if len(frame) < ethHeaderLength+2 {
+		return nil, false
+	}
+	etherType := (uint16(frame[12]) << 8) | uint16(frame[13])
+	payload := frame[ethHeaderLength:]
+	if etherType == uint16(etherTypeIPX) {
+		// ETHERNET_II framing type.
+		return payload, true
+	}
+	if etherType > 1500 {
+		// Some other protocol.
+		return nil, false
+	}
+	// An 802.3 frame; the EtherType field is the payload length. A
+	// corrupt frame can claim a length too short to hold even the LLC
+	// header bytes inspected below.
+	if int(etherType) < len(payload) {
+		payload = payload[0:etherType]
+	}
+	if len(payload) < llcHeaderLength {
+		return nil, false
+	}
+	switch {
+	case payload[0] == 0xff && payload[1] == 0xff:
+		// Novell "raw" 802.3:
+		// https://en.wikipedia.org/wiki/Ethernet_frame#Novell_raw_IEEE_802.3
+		// "This does not conform to the IEEE 802.3 standard, but
+		// since IPX always has FF as the first two octets" it can be
+		// interpreted correctly.
+		return payload, true
+	case payload[0] == lsapNovell && payload[1] == lsapNovell:
+		// 802.2 framing type.
+		// https://en.wikipedia.org/wiki/IEEE_802.2
+		return payload[llcHeaderLength:], true
+	case payload[0] == lsapSNAP && payload[1] == lsapSNAP:
+		// SNAP header follows the LLC header.
+		if len(payload) < llcHeaderLength+snapHeaderLength {
+			return nil, false
+		}
+		snapType := (uint16(payload[6]) << 8) | uint16(payload[7])
+		if snapType != uint16(etherTypeIPX) {
+			return nil, false
+		}
+		return payload[llcHeaderLength+snapHeaderLength:], true
+	}
+	return nil, false
+}
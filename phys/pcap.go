@@ -4,31 +4,32 @@ package phys
 
 import (
 	"io"
-	"net"
 
-	"github.com/fragglet/ipxbox/ipx"
-	"github.com/google/gopacket"
 	"github.com/google/gopacket/pcap"
 )
 
+// maxFrameLength is the largest Ethernet frame we will encode: header,
+// the largest framing template, and a full-sized payload.
+const maxFrameLength = ethHeaderLength + llcHeaderLength + snapHeaderLength + 1500
+
 var (
 	_ = (io.ReadWriteCloser)(&PcapPhys{})
 )
 
 type PcapPhys struct {
 	handle *pcap.Handle
-	ps     *gopacket.PacketSource
 	framer Framer
+	// Reusable transmit frame buffer; Write() is only ever called
+	// from a single goroutine.
+	frame [maxFrameLength]byte
 }
 
 func NewPcap(handle *pcap.Handle, framer Framer) (*PcapPhys, error) {
 	if err := handle.SetBPFFilter("ipx"); err != nil {
 		return nil, err
 	}
-	ps := gopacket.NewPacketSource(handle, handle.LinkType())
 	return &PcapPhys{
 		handle: handle,
-		ps:     ps,
 		framer: framer,
 	}, nil
 }
@@ -39,14 +40,16 @@ func (p *PcapPhys) Close() error {
 }
 
 // Read implements the io.Reader interface, and will block until an IPX packet
-// is received from the pcap handle.
+// is received from the pcap handle. Frames are read with pcap's zero-copy
+// interface and parsed in place, so the only copy made per packet is the
+// one into the caller's buffer.
 func (p *PcapPhys) Read(result []byte) (int, error) {
 	for {
-		pkt, err := p.ps.NextPacket()
+		frame, _, err := p.handle.ZeroCopyReadPacketData()
 		if err != nil {
 			return 0, nil
 		}
-		payload, ok := GetIPXPayload(pkt)
+		payload, ok := GetIPXPayload(frame)
 		if ok {
 			cnt := len(payload)
 			if len(result) < cnt {
@@ -61,19 +64,11 @@ func (p *PcapPhys) Read(result []byte) (int, error) {
 // Write writes an ethernet frame to the pcap handle containing the given IPX
 // packet as payload.
 func (p *PcapPhys) Write(packet []byte) (int, error) {
-	var hdr ipx.Header
-	if err := hdr.UnmarshalBinary(packet); err != nil {
-		return 0, err
-	}
-	dest := net.HardwareAddr(hdr.Dest.Addr[:])
-	buf := gopacket.NewSerializeBuffer()
-	opts := gopacket.SerializeOptions{}
-	layers, err := p.framer.Frame(dest, packet)
+	frameLen, err := p.framer.EncodeFrame(p.frame[:], packet)
 	if err != nil {
 		return 0, err
 	}
-	gopacket.SerializeLayers(buf, opts, layers...)
-	if err := p.handle.WritePacketData(buf.Bytes()); err != nil {
+	if err := p.handle.WritePacketData(p.frame[0:frameLen]); err != nil {
 		return 0, err
 	}
 	return len(packet), nil
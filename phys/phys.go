@@ -11,8 +11,21 @@ import (
 	"github.com/songgao/water"
 )
 
+// Number of preallocated receive frames cycling through the ring; this
+// bounds how many frames can be buffered ahead of the consumer.
+const numReadFrames = 64
+
 type Phys struct {
 	ifce *water.Interface
+
+	// Preallocated frames cycle between the free ring and the rx
+	// channel: the reader goroutine fills free frames from the TAP
+	// device, discards non-IPX chatter in-process, and queues IPX
+	// frames on rx; ReadBatch hands consumed frames back to free.
+	rx       chan ethernet.Frame
+	free     chan ethernet.Frame
+	consumed []ethernet.Frame
+	readErr  error
 }
 
 var (
@@ -27,31 +40,90 @@ func New(cfg water.Config) (*Phys, error) {
 	if err != nil {
 		return nil, err
 	}
-	return &Phys{ifce}, nil
+	p := &Phys{
+		ifce: ifce,
+		rx:   make(chan ethernet.Frame, numReadFrames),
+		free: make(chan ethernet.Frame, numReadFrames),
+	}
+	for i := 0; i < numReadFrames; i++ {
+		var frame ethernet.Frame
+		frame.Resize(1500)
+		p.free <- frame
+	}
+	go p.readFrames()
+	return p, nil
 }
 
-// Read implements the io.Reader interface, and will block until an IPX packet
-// is received from the TAP device.
-func (p *Phys) Read(result []byte) (int, error) {
-	var frame ethernet.Frame
+// readFrames continually reads frames from the TAP device into free
+// frames from the ring, filtering out everything that is not IPX so that
+// the consumer is never woken for ARP/IP chatter.
+func (p *Phys) readFrames() {
 	for {
+		frame := <-p.free
 		frame.Resize(1500)
 		n, err := p.ifce.Read([]byte(frame))
 		if err != nil {
-			return 0, err
+			p.readErr = err
+			close(p.rx)
+			return
 		}
 		frame = frame[:n]
-		if frame.Ethertype() == ethernet.IPX1 {
-			break
+		if frame.Ethertype() != ethernet.IPX1 {
+			p.free <- frame
+			continue
 		}
+		p.rx <- frame
+	}
+}
+
+// ReadBatch reads a batch of received IPX payloads, blocking until at
+// least one frame is available and then returning every frame that has
+// accumulated, up to len(payloads). The returned slices point into the
+// preallocated frame ring and are only valid until the next call to
+// ReadBatch or Read.
+func (p *Phys) ReadBatch(payloads [][]byte) (int, error) {
+	// Frames from the previous batch can now be reused.
+	for _, frame := range p.consumed {
+		p.free <- frame
+	}
+	p.consumed = p.consumed[:0]
+
+	frame, ok := <-p.rx
+	if !ok {
+		return 0, p.readErr
+	}
+	count := 0
+	for {
+		p.consumed = append(p.consumed, frame)
+		payloads[count] = frame.Payload()
+		count++
+		if count >= len(payloads) {
+			return count, nil
+		}
+		select {
+		case frame, ok = <-p.rx:
+			if !ok {
+				return count, nil
+			}
+		default:
+			return count, nil
+		}
+	}
+}
+
+// Read implements the io.Reader interface, and will block until an IPX packet
+// is received from the TAP device.
+func (p *Phys) Read(result []byte) (int, error) {
+	var payloads [1][]byte
+	n, err := p.ReadBatch(payloads[:])
+	if err != nil || n == 0 {
+		return 0, err
 	}
-	// We got an IPX frame
-	pl := frame.Payload()
-	cnt := len(pl)
+	cnt := len(payloads[0])
 	if len(result) < cnt {
 		cnt = len(result)
 	}
-	copy(result[0:cnt], pl[0:cnt])
+	copy(result[0:cnt], payloads[0][0:cnt])
 	return cnt, nil
 }
 
@@ -0,0 +1,57 @@
+// Package pool provides a shared pool of fixed-size packet buffers.
+// Buffers are reference counted so that a single received packet can be
+// handed to many consumers (eg. a broadcast fan-out) and returned to the
+// pool when the last consumer releases it, keeping the packet path free
+// of per-packet heap allocations.
+package pool
+
+import (
+	"sync"
+	"sync/atomic"
+)
+
+// DefaultBufferSize is the standard Ethernet MTU, large enough for any
+// IPX packet a stock client will send.
+const DefaultBufferSize = 1500
+
+// BufferSize is the size in bytes of each pooled buffer, and therefore
+// the largest IPX packet the server will forward. It may be raised at
+// startup to support jumbo packets (the -mtu flag), but must not change
+// once any buffer is in circulation.
+var BufferSize = DefaultBufferSize
+
+// Buffer is a pooled packet buffer. Data is resliced by the producer to
+// the length of the packet it holds; its capacity is always BufferSize.
+type Buffer struct {
+	Data []byte
+	refs int32
+}
+
+var bufPool = sync.Pool{
+	New: func() interface{} {
+		return &Buffer{Data: make([]byte, BufferSize)}
+	},
+}
+
+// Get returns a buffer from the pool with a reference count of one. The
+// caller owns the buffer until it calls Release.
+func Get() *Buffer {
+	b := bufPool.Get().(*Buffer)
+	atomic.StoreInt32(&b.refs, 1)
+	return b
+}
+
+// AddRef adds a reference to the buffer, for handing it to another
+// consumer; each reference must be dropped with its own Release call.
+func (b *Buffer) AddRef() {
+	atomic.AddInt32(&b.refs, 1)
+}
+
+// Release drops a reference to the buffer, returning it to the pool when
+// the last reference is dropped.
+func (b *Buffer) Release() {
+	if atomic.AddInt32(&b.refs, -1) == 0 {
+		b.Data = b.Data[0:cap(b.Data)]
+		bufPool.Put(b)
+	}
+}
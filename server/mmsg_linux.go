@@ -0,0 +1,283 @@
+//go:build linux && (386 || amd64 || arm || arm64)
+// +build linux
+// +build 386 amd64 arm arm64
+
+// Batched UDP I/O built on the Linux recvmmsg() and sendmmsg() system
+// calls. Reading drains up to batchSize datagrams from the socket in a
+// single system call, and writes are queued and flushed in batches by a
+// background goroutine, so that under load the syscall cost is amortized
+// over many packets.
+package server
+
+import (
+	"net"
+	"sync"
+	"syscall"
+	"unsafe"
+
+	"github.com/fragglet/ipxbox/pool"
+)
+
+// mmsghdr mirrors the kernel's struct mmsghdr. The Go compiler pads the
+// struct out to the alignment of syscall.Msghdr, which matches the array
+// stride that the kernel expects on both 32- and 64-bit platforms.
+type mmsghdr struct {
+	hdr    syscall.Msghdr
+	msgLen uint32
+}
+
+// batchReader reads datagrams from a UDP socket many at a time, returning
+// them to the caller one by one from a pre-allocated message vector.
+type batchReader struct {
+	raw   syscall.RawConn
+	msgs  []mmsghdr
+	bufs  [][]byte
+	iovs  []syscall.Iovec
+	names []syscall.RawSockaddrInet4
+	count int
+	next  int
+}
+
+// outPacket is a queued outbound datagram awaiting a batched send. The
+// buffer is owned by the queue and released once sent.
+type outPacket struct {
+	buf  *pool.Buffer
+	name syscall.RawSockaddrInet4
+}
+
+// batchWriter queues outbound datagrams and flushes them with sendmmsg()
+// from a background goroutine started by the server.
+type batchWriter struct {
+	raw       syscall.RawConn
+	batchSize int
+	msgs      []mmsghdr
+	iovs      []syscall.Iovec
+	wake      chan struct{}
+	mu        sync.Mutex
+	queue     []outPacket
+	closed    bool
+}
+
+// newBatchIO creates a batched reader and writer for the given socket.
+func newBatchIO(socket *net.UDPConn, batchSize int) (*batchReader, *batchWriter, error) {
+	raw, err := socket.SyscallConn()
+	if err != nil {
+		return nil, nil, err
+	}
+	r := &batchReader{
+		raw:   raw,
+		msgs:  make([]mmsghdr, batchSize),
+		bufs:  make([][]byte, batchSize),
+		iovs:  make([]syscall.Iovec, batchSize),
+		names: make([]syscall.RawSockaddrInet4, batchSize),
+	}
+	for i := range r.msgs {
+		r.bufs[i] = make([]byte, pool.BufferSize)
+		r.iovs[i].Base = &r.bufs[i][0]
+		r.iovs[i].SetLen(len(r.bufs[i]))
+		r.msgs[i].hdr.Name = (*byte)(unsafe.Pointer(&r.names[i]))
+		r.msgs[i].hdr.Iov = &r.iovs[i]
+		r.msgs[i].hdr.Iovlen = 1
+	}
+	w := &batchWriter{
+		raw:       raw,
+		batchSize: batchSize,
+		msgs:      make([]mmsghdr, batchSize),
+		iovs:      make([]syscall.Iovec, batchSize),
+		wake:      make(chan struct{}, 1),
+	}
+	return r, w, nil
+}
+
+// setSockaddr fills in a raw IPv4 socket address from a UDP address,
+// returning false if the address is not an IPv4 address.
+func setSockaddr(name *syscall.RawSockaddrInet4, addr *net.UDPAddr) bool {
+	ip4 := addr.IP.To4()
+	if ip4 == nil {
+		return false
+	}
+	name.Family = syscall.AF_INET
+	// sin_port is in network byte order regardless of host endianness.
+	p := (*[2]byte)(unsafe.Pointer(&name.Port))
+	p[0] = byte(addr.Port >> 8)
+	p[1] = byte(addr.Port)
+	copy(name.Addr[:], ip4)
+	return true
+}
+
+// getSockaddr converts a raw IPv4 socket address into a UDP address.
+func getSockaddr(name *syscall.RawSockaddrInet4) *net.UDPAddr {
+	p := (*[2]byte)(unsafe.Pointer(&name.Port))
+	return &net.UDPAddr{
+		IP:   net.IPv4(name.Addr[0], name.Addr[1], name.Addr[2], name.Addr[3]),
+		Port: int(p[0])<<8 | int(p[1]),
+	}
+}
+
+// refill performs a single recvmmsg() call to fill the message vector,
+// blocking until at least one datagram arrives or the socket's read
+// deadline is reached.
+func (r *batchReader) refill() error {
+	for i := range r.msgs {
+		r.msgs[i].hdr.Namelen = uint32(unsafe.Sizeof(r.names[i]))
+		r.iovs[i].SetLen(len(r.bufs[i]))
+	}
+	var n uintptr
+	var errno syscall.Errno
+	err := r.raw.Read(func(fd uintptr) bool {
+		n, _, errno = syscall.Syscall6(sysRECVMMSG, fd,
+			uintptr(unsafe.Pointer(&r.msgs[0])), uintptr(len(r.msgs)),
+			syscall.MSG_DONTWAIT, 0, 0)
+		return errno != syscall.EAGAIN && errno != syscall.EWOULDBLOCK
+	})
+	if err != nil {
+		return err
+	}
+	if errno != 0 {
+		return errno
+	}
+	r.count = int(n)
+	r.next = 0
+	return nil
+}
+
+// read returns the next received datagram, performing a batched read from
+// the socket only when the message vector has been drained. The returned
+// slice is only valid until the next call to read.
+func (r *batchReader) read() ([]byte, *net.UDPAddr, error) {
+	if r.next >= r.count {
+		if err := r.refill(); err != nil {
+			return nil, nil, err
+		}
+	}
+	i := r.next
+	r.next++
+	return r.bufs[i][0:r.msgs[i].msgLen], getSockaddr(&r.names[i]), nil
+}
+
+// enqueueOwned adds a pooled packet buffer to the outbound queue, waking
+// the flush goroutine. On success, ownership of the buffer passes to the
+// queue; on failure, the caller keeps ownership and should send the
+// packet directly instead.
+func (w *batchWriter) enqueueOwned(b *pool.Buffer, addr *net.UDPAddr) bool {
+	var pkt outPacket
+	if !setSockaddr(&pkt.name, addr) {
+		return false
+	}
+	pkt.buf = b
+	w.mu.Lock()
+	if w.closed {
+		w.mu.Unlock()
+		return false
+	}
+	w.queue = append(w.queue, pkt)
+	w.mu.Unlock()
+	select {
+	case w.wake <- struct{}{}:
+	default:
+	}
+	return true
+}
+
+// enqueue adds a packet to the outbound queue, copying it into a pooled
+// buffer; the caller may reuse the packet slice. Returns false if the
+// packet cannot be queued and should be sent directly instead.
+func (w *batchWriter) enqueue(packet []byte, addr *net.UDPAddr) bool {
+	if len(packet) > pool.BufferSize {
+		return false
+	}
+	b := pool.Get()
+	b.Data = b.Data[0:len(packet)]
+	copy(b.Data, packet)
+	if !w.enqueueOwned(b, addr) {
+		b.Release()
+		return false
+	}
+	return true
+}
+
+// flush sends the given packets, at most batchSize per sendmmsg() call,
+// releasing each packet's buffer once it has been handed to the kernel.
+func (w *batchWriter) flush(queue []outPacket) error {
+	releaseFrom := 0
+	defer func() {
+		// On error, unsent packets are dropped.
+		for i := releaseFrom; i < len(queue); i++ {
+			queue[i].buf.Release()
+		}
+	}()
+	for releaseFrom < len(queue) {
+		chunk := queue[releaseFrom:]
+		count := len(chunk)
+		if count > w.batchSize {
+			count = w.batchSize
+		}
+		for i := 0; i < count; i++ {
+			w.iovs[i].Base = &chunk[i].buf.Data[0]
+			w.iovs[i].SetLen(len(chunk[i].buf.Data))
+			w.msgs[i].hdr.Name = (*byte)(unsafe.Pointer(&chunk[i].name))
+			w.msgs[i].hdr.Namelen = uint32(unsafe.Sizeof(chunk[i].name))
+			w.msgs[i].hdr.Iov = &w.iovs[i]
+			w.msgs[i].hdr.Iovlen = 1
+		}
+		var n uintptr
+		var errno syscall.Errno
+		err := w.raw.Write(func(fd uintptr) bool {
+			n, _, errno = syscall.Syscall6(sysSENDMMSG, fd,
+				uintptr(unsafe.Pointer(&w.msgs[0])), uintptr(count),
+				syscall.MSG_DONTWAIT, 0, 0)
+			return errno != syscall.EAGAIN && errno != syscall.EWOULDBLOCK
+		})
+		if err != nil {
+			return err
+		}
+		if errno != 0 {
+			return errno
+		}
+		for i := 0; i < int(n); i++ {
+			chunk[i].buf.Release()
+		}
+		releaseFrom += int(n)
+	}
+	return nil
+}
+
+// run repeatedly flushes the outbound queue until close() is called. It
+// should be invoked in a dedicated goroutine. Under load the queue grows
+// while a flush is in progress, so batches form naturally.
+func (w *batchWriter) run() {
+	for {
+		<-w.wake
+		for {
+			w.mu.Lock()
+			queue := w.queue
+			closed := w.closed
+			w.queue = nil
+			w.mu.Unlock()
+			if len(queue) > 0 {
+				// A failed flush has already released the rest of
+				// the batch; transient send errors (e.g. ENOBUFS
+				// under sustained load) drop those packets but must
+				// not stop the writer, or the shard would silently
+				// never transmit again.
+				w.flush(queue)
+				continue
+			}
+			if closed {
+				return
+			}
+			break
+		}
+	}
+}
+
+// close shuts down the flush goroutine once the queue has drained.
+func (w *batchWriter) close() {
+	w.mu.Lock()
+	w.closed = true
+	w.mu.Unlock()
+	select {
+	case w.wake <- struct{}{}:
+	default:
+	}
+}
@@ -0,0 +1,11 @@
+//go:build linux && 386
+// +build linux,386
+
+package server
+
+// System call numbers for recvmmsg() and sendmmsg(), which are not
+// present in the syscall package's frozen tables on all platforms.
+const (
+	sysRECVMMSG = 337
+	sysSENDMMSG = 345
+)
@@ -0,0 +1,11 @@
+//go:build linux && amd64
+// +build linux,amd64
+
+package server
+
+// System call numbers for recvmmsg() and sendmmsg(), which are not
+// present in the syscall package's frozen tables on all platforms.
+const (
+	sysRECVMMSG = 299
+	sysSENDMMSG = 307
+)
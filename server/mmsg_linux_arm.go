@@ -0,0 +1,11 @@
+//go:build linux && arm
+// +build linux,arm
+
+package server
+
+// System call numbers for recvmmsg() and sendmmsg(), which are not
+// present in the syscall package's frozen tables on all platforms.
+const (
+	sysRECVMMSG = 365
+	sysSENDMMSG = 374
+)
@@ -0,0 +1,39 @@
+//go:build !linux || !(386 || amd64 || arm || arm64)
+// +build !linux !386,!amd64,!arm,!arm64
+
+package server
+
+import (
+	"errors"
+	"net"
+
+	"github.com/fragglet/ipxbox/pool"
+)
+
+// batchReader is a stub for platforms without batched UDP I/O support.
+type batchReader struct{}
+
+// batchWriter is a stub for platforms without batched UDP I/O support.
+type batchWriter struct{}
+
+// newBatchIO always fails on platforms that lack recvmmsg()/sendmmsg();
+// the server falls back to one system call per packet.
+func newBatchIO(socket *net.UDPConn, batchSize int) (*batchReader, *batchWriter, error) {
+	return nil, nil, errors.New("batched UDP I/O not supported on this platform")
+}
+
+func (r *batchReader) read() ([]byte, *net.UDPAddr, error) {
+	return nil, nil, errors.New("not supported")
+}
+
+func (w *batchWriter) enqueue(packet []byte, addr *net.UDPAddr) bool {
+	return false
+}
+
+func (w *batchWriter) enqueueOwned(b *pool.Buffer, addr *net.UDPAddr) bool {
+	return false
+}
+
+func (w *batchWriter) run() {}
+
+func (w *batchWriter) close() {}
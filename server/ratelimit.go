@@ -0,0 +1,78 @@
+package server
+
+// tokenBucket is a token bucket refilled lazily with integer arithmetic
+// from the timestamp of each packet as it arrives; there are no timers
+// or goroutines behind it and checking a packet costs a couple of adds.
+// Buckets are only ever touched by their shard's receive goroutine, so
+// no locking is needed either.
+type tokenBucket struct {
+	rate       int64 // Tokens added per second; zero disables the bucket.
+	burst      int64 // Cap on accumulated tokens.
+	tokens     int64
+	lastUpdate int64 // time.Time in nanoseconds.
+}
+
+// newTokenBucket creates a bucket with the given refill rate that starts
+// full, allowing bursts of up to one second's worth of tokens.
+func newTokenBucket(rate int, now int64) tokenBucket {
+	return tokenBucket{
+		rate:       int64(rate),
+		burst:      int64(rate),
+		tokens:     int64(rate),
+		lastUpdate: now,
+	}
+}
+
+// spend refills the bucket according to the time elapsed since the last
+// packet and then tries to remove the given number of tokens, returning
+// false if the budget is exhausted.
+func (b *tokenBucket) spend(now int64, cost int64) bool {
+	if b.rate == 0 {
+		return true
+	}
+	elapsed := now - b.lastUpdate
+	added := elapsed * b.rate / 1e9
+	b.tokens += added
+	// Advance lastUpdate only by the time corresponding to the whole
+	// tokens credited, so the fractional remainder carries over to the
+	// next packet. Consuming the full interval would discard the
+	// fraction every call, starving a client that sends at close to
+	// its configured rate of nearly all refills.
+	b.lastUpdate += added * 1e9 / b.rate
+	if b.tokens > b.burst {
+		b.tokens = b.burst
+	}
+	if b.tokens < cost {
+		return false
+	}
+	b.tokens -= cost
+	return true
+}
+
+// clientLimiter enforces a client's traffic budgets: packets and bytes
+// per second, with a separate tighter budget for broadcast packets since
+// the network multiplies those by the node count.
+type clientLimiter struct {
+	packets    tokenBucket
+	bytes      tokenBucket
+	broadcasts tokenBucket
+}
+
+func newClientLimiter(config *Config, now int64) clientLimiter {
+	return clientLimiter{
+		packets:    newTokenBucket(config.MaxPacketsPerSec, now),
+		bytes:      newTokenBucket(config.MaxBytesPerSec, now),
+		broadcasts: newTokenBucket(config.MaxBroadcastsPerSec, now),
+	}
+}
+
+// spend charges one packet of the given size against the client's
+// budgets, returning false if the packet should be dropped.
+func (l *clientLimiter) spend(now int64, packetLen int, broadcast bool) bool {
+	ok := l.packets.spend(now, 1)
+	ok = l.bytes.spend(now, int64(packetLen)) && ok
+	if broadcast {
+		ok = l.broadcasts.spend(now, 1) && ok
+	}
+	return ok
+}
@@ -0,0 +1,75 @@
+package server
+
+import (
+	"testing"
+	"time"
+)
+
+func TestBucketLimitsRate(t *testing.T) {
+	now := time.Now().UnixNano()
+	b := newTokenBucket(10, now)
+	// The bucket starts full, so one second's budget is available
+	// immediately; the next packet must be refused.
+	for i := 0; i < 10; i++ {
+		if !b.spend(now, 1) {
+			t.Fatalf("packet %d refused within budget", i)
+		}
+	}
+	if b.spend(now, 1) {
+		t.Errorf("packet accepted over budget")
+	}
+	// After 100ms one token should have been refilled.
+	now += int64(100 * time.Millisecond)
+	if !b.spend(now, 1) {
+		t.Errorf("packet refused after refill")
+	}
+	if b.spend(now, 1) {
+		t.Errorf("second packet accepted after single-token refill")
+	}
+}
+
+func TestBucketBurstIsCapped(t *testing.T) {
+	now := time.Now().UnixNano()
+	b := newTokenBucket(10, now)
+	// However long the client stays idle, it cannot accumulate more
+	// than one second's worth of budget.
+	now += int64(time.Hour)
+	for i := 0; i < 10; i++ {
+		if !b.spend(now, 1) {
+			t.Fatalf("packet %d refused within burst", i)
+		}
+	}
+	if b.spend(now, 1) {
+		t.Errorf("burst not capped")
+	}
+}
+
+func TestZeroRateDisablesBucket(t *testing.T) {
+	now := time.Now().UnixNano()
+	b := newTokenBucket(0, now)
+	for i := 0; i < 1000; i++ {
+		if !b.spend(now, 100) {
+			t.Fatalf("disabled bucket refused a packet")
+		}
+	}
+}
+
+func TestSustainedRateKeepsRefilling(t *testing.T) {
+	now := time.Now().UnixNano()
+	b := newTokenBucket(100, now)
+	// A client sending just under 10ms apart refills slightly less
+	// than one token per packet; the fractional credit must carry
+	// over rather than being rounded away, so over 100 seconds the
+	// bucket shapes the stream to roughly its configured rate instead
+	// of refusing everything after the initial burst.
+	accepted := 0
+	for i := 0; i < 10000; i++ {
+		now += 9999999
+		if b.spend(now, 1) {
+			accepted++
+		}
+	}
+	if accepted < 9000 {
+		t.Errorf("only %d of 10000 packets accepted at sustained rate", accepted)
+	}
+}
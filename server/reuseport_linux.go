@@ -0,0 +1,65 @@
+//go:build linux
+// +build linux
+
+package server
+
+import (
+	"context"
+	"net"
+	"syscall"
+)
+
+// Linux value of SO_REUSEPORT, which is not defined by the syscall
+// package's frozen constant tables.
+const soREUSEPORT = 0xf
+
+// listenReusePort opens a UDP socket bound to the given address with
+// SO_REUSEPORT set, so that several sockets can share the same port with
+// the kernel load-balancing received packets between them.
+func listenReusePort(addr *net.UDPAddr) (*net.UDPConn, error) {
+	lc := net.ListenConfig{
+		Control: func(network, address string, c syscall.RawConn) error {
+			var serr error
+			err := c.Control(func(fd uintptr) {
+				serr = syscall.SetsockoptInt(int(fd),
+					syscall.SOL_SOCKET, soREUSEPORT, 1)
+			})
+			if err != nil {
+				return err
+			}
+			return serr
+		},
+	}
+	conn, err := lc.ListenPacket(context.Background(), "udp4", addr.String())
+	if err != nil {
+		return nil, err
+	}
+	return conn.(*net.UDPConn), nil
+}
+
+// dialReusePort opens a UDP socket bound to the given local address with
+// SO_REUSEPORT set and connects it to the given remote address. The local
+// port can be shared with the server's listening sockets; the kernel then
+// delivers packets from the remote address to this socket in preference
+// to the unconnected listeners.
+func dialReusePort(laddr, raddr *net.UDPAddr) (*net.UDPConn, error) {
+	d := net.Dialer{
+		LocalAddr: laddr,
+		Control: func(network, address string, c syscall.RawConn) error {
+			var serr error
+			err := c.Control(func(fd uintptr) {
+				serr = syscall.SetsockoptInt(int(fd),
+					syscall.SOL_SOCKET, soREUSEPORT, 1)
+			})
+			if err != nil {
+				return err
+			}
+			return serr
+		},
+	}
+	conn, err := d.Dial("udp4", raddr.String())
+	if err != nil {
+		return nil, err
+	}
+	return conn.(*net.UDPConn), nil
+}
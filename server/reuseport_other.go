@@ -0,0 +1,23 @@
+//go:build !linux
+// +build !linux
+
+package server
+
+import (
+	"errors"
+	"net"
+)
+
+// listenReusePort is only supported on Linux, where the kernel balances
+// received packets between the sockets sharing a port. Running with more
+// than one shard is not possible on other platforms.
+func listenReusePort(addr *net.UDPAddr) (*net.UDPConn, error) {
+	return nil, errors.New("SO_REUSEPORT listener groups not supported on this platform")
+}
+
+// dialReusePort is only supported on Linux; without it connected
+// per-client sockets are unavailable and clients are served through the
+// shared listening socket.
+func dialReusePort(laddr, raddr *net.UDPAddr) (*net.UDPConn, error) {
+	return nil, errors.New("SO_REUSEPORT connected sockets not supported on this platform")
+}
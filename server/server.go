@@ -6,10 +6,34 @@ import (
 	"io"
 	"net"
 	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/fragglet/ipxbox/ipx"
+	"github.com/fragglet/ipxbox/metrics"
 	"github.com/fragglet/ipxbox/network"
+	"github.com/fragglet/ipxbox/pool"
+)
+
+// Counters instrumenting the receive and send paths; these are atomics
+// and are shared by all shards.
+var (
+	metricRXPackets = metrics.NewCounter("ipxbox.server.rx_packets")
+	metricRXBytes   = metrics.NewCounter("ipxbox.server.rx_bytes")
+	metricTXPackets = metrics.NewCounter("ipxbox.server.tx_packets")
+	metricTXBytes   = metrics.NewCounter("ipxbox.server.tx_bytes")
+
+	// Received packets dropped because the sender is not a registered
+	// client or is using the wrong source address.
+	metricUnknownClientDrops = metrics.NewCounter("ipxbox.server.unknown_client_drops")
+
+	// Received packets dropped because the client exceeded its
+	// traffic budget.
+	metricRateLimitDrops = metrics.NewCounter("ipxbox.server.rate_limit_drops")
+
+	// Packets dropped because they exceed the destination client's
+	// maximum packet size.
+	metricOversizeDrops = metrics.NewCounter("ipxbox.server.oversize_drops")
 )
 
 // Config contains configuration parameters for an IPX server.
@@ -23,25 +47,206 @@ type Config struct {
 	// packets on particular ports if nothing is received for a while.
 	// This controls the time for keepalives.
 	KeepaliveTime time.Duration
+
+	// Maximum number of datagrams to read or write per system call.
+	// When greater than one, received packets are drained from the
+	// socket in batches and outbound packets are queued and flushed
+	// in batches, using recvmmsg()/sendmmsg() where the platform
+	// supports them. A value of one reads and writes one packet per
+	// system call.
+	BatchSize int
+
+	// Traffic budgets enforced per client with token buckets; packets
+	// beyond the budget are dropped. Broadcasts get a separate,
+	// typically tighter, budget because the network multiplies them
+	// by the number of nodes. A value of zero disables the
+	// corresponding limit.
+	MaxPacketsPerSec    int
+	MaxBytesPerSec      int
+	MaxBroadcastsPerSec int
+
+	// Number of packet processing shards. When greater than one, the
+	// server opens this many sockets on the same port, all bound with
+	// SO_REUSEPORT, and runs an independent receive loop for each.
+	// The kernel hashes each client's address onto one socket, so each
+	// client's state lives on exactly one shard and the receive path
+	// needs no cross-shard locking. A value of one runs a single
+	// receive loop as before.
+	Shards int
+
+	// If true, each registered client gets its own UDP socket,
+	// connected to the client's address and bound to the server port
+	// with SO_REUSEPORT. Sends to the client then use the kernel's
+	// cached route rather than a per-send route lookup, and received
+	// packets from established clients are demultiplexed by the
+	// kernel instead of the clients map. Only supported on Linux;
+	// elsewhere, and for clients the kernel refuses to connect,
+	// traffic falls back to the shared socket.
+	ConnectedSockets bool
+}
+
+// Protocol extensions are negotiated during registration: a client
+// appends the extension magic and a flags word to its registration
+// packet, and the server replies in kind with the flags it accepted.
+// Stock DOSBox clients send bare registration packets and are
+// unaffected.
+var extensionMagic = [4]byte{'I', 'P', 'X', 'E'}
+
+const (
+	// The server may coalesce multiple queued packets for the client
+	// into one UDP datagram. Every subsequent server-to-client
+	// datagram is then a concatenation of length-prefixed packets.
+	extensionFlagAggregation = 0x0001
+
+	// The client requests a larger maximum packet size; the trailer
+	// then carries the requested size as an extra 16-bit value after
+	// the flags, and the server replies with the size it granted.
+	extensionFlagLargeMTU = 0x0002
+
+	// Flags the server is willing to accept.
+	supportedExtensions = extensionFlagAggregation | extensionFlagLargeMTU
+
+	// Aggregated datagrams are flushed once they grow past this size.
+	aggregateMTU = 1400
+
+	// Smallest maximum packet size a client may negotiate.
+	minNegotiableMTU = 576
+)
+
+// parseExtensions returns the extension flags offered by a registration
+// packet and the requested maximum packet size, or zeroes if the packet
+// carries no extension trailer.
+func parseExtensions(packet []byte) (flags uint16, mtu int) {
+	trailer := packet[ipx.HeaderLength:]
+	if len(trailer) < 6 || [4]byte(trailer[0:4]) != extensionMagic {
+		return 0, 0
+	}
+	flags = (uint16(trailer[4]) << 8) | uint16(trailer[5])
+	if flags&extensionFlagLargeMTU != 0 {
+		if len(trailer) < 8 {
+			return 0, 0
+		}
+		mtu = (int(trailer[6]) << 8) | int(trailer[7])
+	}
+	return flags, mtu
+}
+
+// clientKey is a fixed-size comparable representation of a client's UDP
+// address, used to key the clients map. Unlike UDPAddr.String() it can
+// be derived from a received packet's address without heap allocation;
+// the string form is only needed for logging.
+type clientKey struct {
+	ip   [4]byte
+	port uint16
+}
+
+// makeClientKey derives a clientKey from a UDP address, returning false
+// if the address is not an IPv4 address.
+func makeClientKey(addr *net.UDPAddr) (clientKey, bool) {
+	var key clientKey
+	ip4 := addr.IP.To4()
+	if ip4 == nil {
+		return key, false
+	}
+	copy(key.ip[:], ip4)
+	key.port = uint16(addr.Port)
+	return key, true
 }
 
 // client represents a client that is connected to an IPX server.
 type client struct {
-	addr            *net.UDPAddr
-	node            network.Node
-	lastReceiveTime time.Time
-	lastSendTime    time.Time
+	addr *net.UDPAddr
+	key  clientKey
+	node network.Node
+
+	// Time of last receive from / send to the client, as UnixNano
+	// values accessed atomically; the receive loop updates them and
+	// the shard's timer goroutine reads them to evaluate deadlines.
+	lastReceiveTime int64
+	lastSendTime    int64
+
+	// conn, if non-nil, is a socket connected to the client's address
+	// and sharing the server port; all traffic to and from the client
+	// then flows through it instead of the shard's shared socket.
+	conn *net.UDPConn
+
+	// limiter enforces the client's traffic budgets. It is guarded by
+	// limiterMu because during the handover to a connected socket a
+	// packet may be processed by the shard's receive loop and the
+	// client's socket reader concurrently.
+	limiterMu sync.Mutex
+	limiter   clientLimiter
+
+	// mtu is the largest packet we will send to the client: the
+	// negotiated size for clients that asked for one, the standard
+	// 1500 otherwise.
+	mtu int
+
+	// aggregated is set if the client negotiated datagram
+	// aggregation; every datagram we send it is then a concatenation
+	// of one or more length-prefixed IPX packets. aggBuf accumulates
+	// packets between flushes and is only touched while the client's
+	// sendPending flag is held.
+	aggregated bool
+	aggBuf     []byte
+
+	// qr is set if the node supports event-driven reads, in which
+	// case no runClient goroutine is started for the client; instead
+	// the shard's sender workers service its queue when notified.
+	qr network.QueuedReader
+
+	// sendPending is nonzero while the client is queued for (or being
+	// serviced by) a sender worker; accessed atomically.
+	sendPending int32
 }
 
+// shard is an independent receive loop with its own socket and its own
+// set of clients. The kernel's SO_REUSEPORT hashing consistently maps
+// each client address to the same socket, so only the owning shard ever
+// touches a client's state and no locking is needed on the packet path.
+type shard struct {
+	server *Server
+	socket *net.UDPConn
+	rx     *batchReader
+	tx     *batchWriter
+
+	// readBuf is the receive buffer used by the shard's own receive
+	// loop when batched I/O is not in use.
+	readBuf []byte
+
+	// mu protects the clients map. It is only ever contended at
+	// shutdown: on the packet path it is taken and released by the
+	// shard's own goroutine, so it stays in the uncontended fast
+	// path and does not serialize the shards against each other.
+	mu      sync.Mutex
+	clients map[clientKey]*client
+
+	// timerMu protects the heap of keepalive and timeout deadlines,
+	// which is serviced by the shard's timer goroutine.
+	timerMu     sync.Mutex
+	timers      deadlineHeap
+	timerClosed bool
+	timerWake   chan struct{}
+
+	// sendMu protects the queue of clients with packets awaiting a
+	// sender worker.
+	sendMu       sync.Mutex
+	readyClients []*client
+	senderClosed bool
+	sendWake     chan struct{}
+}
+
+// Number of sender worker goroutines per shard servicing the outbound
+// queues of all of the shard's clients.
+const numSenderWorkers = 2
+
 // Server is the top-level struct representing an IPX server that listens
 // on a UDP port.
 type Server struct {
-	net              network.Network
-	mu               sync.Mutex
-	config           *Config
-	socket           *net.UDPConn
-	clients          map[string]*client
-	timeoutCheckTime time.Time
+	net    network.Network
+	mu     sync.Mutex
+	config *Config
+	shards []*shard
 }
 
 var (
@@ -52,44 +257,291 @@ var (
 	DefaultConfig = &Config{
 		ClientTimeout: 10 * time.Minute,
 		KeepaliveTime: 5 * time.Second,
+		BatchSize:     16,
+		Shards:        1,
 	}
 
 	// Server-initiated pings come from this address.
 	addrPingReply = [6]byte{0x02, 0xff, 0xff, 0xff, 0x00, 0x00}
 
+	// The encoded ping datagram, which is identical for every client;
+	// the framed form carries the length prefix sent to aggregated
+	// clients. Both are encoded once here so that sendPing does no
+	// marshalling.
+	pingPacket, pingPacketFramed = encodePingPacket()
+
+	// The encoded registration reply header, with the destination node
+	// address left blank; newClient patches each client's address over
+	// the bytes at replyNodeOffset instead of re-encoding the header
+	// for every registration.
+	replyTemplate = encodeReplyTemplate()
+
 	_ = (io.Closer)(&Server{})
 )
 
+// Byte offset of the destination node address within an encoded
+// registration reply header.
+const replyNodeOffset = 10
+
+// encodePingPacket builds the ping datagram. The DOSbox IPX client code
+// recognizes broadcast packets sent to socket=2 and will send a reply to
+// the source address that we provide.
+func encodePingPacket() ([]byte, []byte) {
+	header := &ipx.Header{
+		Dest: ipx.HeaderAddr{
+			Addr:   ipx.AddrBroadcast,
+			Socket: 2,
+		},
+		// We "send" the pings from an imaginary "ping reply" address
+		// because if we used ipx.AddrNull the reply would be
+		// indistinguishable from a registration packet.
+		Src: ipx.HeaderAddr{
+			Addr:   addrPingReply,
+			Socket: 0,
+		},
+	}
+	framed := make([]byte, ipx.HeaderLength+2)
+	framed[1] = ipx.HeaderLength
+	if err := header.MarshalTo(framed[2:]); err != nil {
+		panic(err)
+	}
+	return framed[2:], framed
+}
+
+// encodeReplyTemplate builds the constant part of the registration
+// reply.
+func encodeReplyTemplate() []byte {
+	reply := &ipx.Header{
+		Checksum:     0xffff,
+		Length:       30,
+		TransControl: 0,
+		Dest: ipx.HeaderAddr{
+			Network: [4]byte{0, 0, 0, 0},
+			Socket:  2,
+		},
+		Src: ipx.HeaderAddr{
+			Network: [4]byte{0, 0, 0, 1},
+			Addr:    ipx.AddrBroadcast,
+			Socket:  2,
+		},
+	}
+	encoded := make([]byte, ipx.HeaderLength)
+	if err := reply.MarshalTo(encoded); err != nil {
+		panic(err)
+	}
+	return encoded
+}
+
+// newShard creates a shard around the given socket.
+func (s *Server) newShard(socket *net.UDPConn) *shard {
+	sh := &shard{
+		server:    s,
+		socket:    socket,
+		readBuf:   make([]byte, pool.BufferSize),
+		clients:   map[clientKey]*client{},
+		sendWake:  make(chan struct{}, numSenderWorkers),
+		timerWake: make(chan struct{}, 1),
+	}
+	for i := 0; i < numSenderWorkers; i++ {
+		go sh.senderWorker()
+	}
+	go sh.runTimers()
+	if s.config.BatchSize > 1 {
+		// If batched I/O is unavailable we silently fall back to
+		// one system call per packet.
+		rx, tx, err := newBatchIO(socket, s.config.BatchSize)
+		if err == nil {
+			sh.rx = rx
+			sh.tx = tx
+			go tx.run()
+		}
+	}
+	return sh
+}
+
 // New creates a new Server, listening on the given address.
 func New(addr string, n network.Network, c *Config) (*Server, error) {
 	udp4Addr, err := net.ResolveUDPAddr("udp4", addr)
 	if err != nil {
 		return nil, err
 	}
-	socket, err := net.ListenUDP("udp", udp4Addr)
-	if err != nil {
-		return nil, err
+	numShards := c.Shards
+	if numShards < 1 {
+		numShards = 1
 	}
 	s := &Server{
-		net:              n,
-		config:           c,
-		socket:           socket,
-		clients:          map[string]*client{},
-		timeoutCheckTime: time.Now().Add(10e9),
+		net:    n,
+		config: c,
+	}
+	if numShards == 1 && !c.ConnectedSockets {
+		// Bind an IPv4-only socket: only IPv4 clients are supported,
+		// and on a dual-stack socket received source addresses come
+		// back as sockaddr_in6, which the batched reader's fixed
+		// sockaddr_in vector would misparse.
+		socket, err := net.ListenUDP("udp4", udp4Addr)
+		if err != nil {
+			return nil, err
+		}
+		s.shards = []*shard{s.newShard(socket)}
+		return s, nil
+	}
+	// Multiple shards all listen on the same port with SO_REUSEPORT
+	// set; the kernel balances clients between the sockets. Connected
+	// per-client sockets also need SO_REUSEPORT on the listener so that
+	// they can share its port, even with a single shard.
+	for i := 0; i < numShards; i++ {
+		socket, err := listenReusePort(udp4Addr)
+		if err != nil {
+			s.Close()
+			return nil, err
+		}
+		s.shards = append(s.shards, s.newShard(socket))
 	}
 	return s, nil
 }
 
+// sendTo transmits a packet to the given UDP address, queueing it for a
+// batched send if batched I/O is in use.
+func (sh *shard) sendTo(packet []byte, addr *net.UDPAddr) {
+	metricTXPackets.Add(1)
+	metricTXBytes.Add(uint64(len(packet)))
+	if sh.tx != nil && sh.tx.enqueue(packet, addr) {
+		return
+	}
+	sh.socket.WriteToUDP(packet, addr)
+}
+
+// sendBuffer transmits a pooled packet buffer to the given UDP address,
+// taking ownership of the buffer.
+func (sh *shard) sendBuffer(b *pool.Buffer, addr *net.UDPAddr) {
+	metricTXPackets.Add(1)
+	metricTXBytes.Add(uint64(len(b.Data)))
+	if sh.tx != nil && sh.tx.enqueueOwned(b, addr) {
+		return
+	}
+	sh.socket.WriteToUDP(b.Data, addr)
+	b.Release()
+}
+
+// sendToClient transmits a packet to the given client, through its
+// connected socket if it has one.
+func (sh *shard) sendToClient(c *client, packet []byte) {
+	if c.conn != nil {
+		metricTXPackets.Add(1)
+		metricTXBytes.Add(uint64(len(packet)))
+		c.conn.Write(packet)
+		return
+	}
+	sh.sendTo(packet, c.addr)
+}
+
+// sendBufferToClient transmits a pooled packet buffer to the given
+// client, taking ownership of the buffer.
+func (sh *shard) sendBufferToClient(c *client, b *pool.Buffer) {
+	if c.conn != nil {
+		metricTXPackets.Add(1)
+		metricTXBytes.Add(uint64(len(b.Data)))
+		c.conn.Write(b.Data)
+		b.Release()
+		return
+	}
+	sh.sendBuffer(b, c.addr)
+}
+
+// sendFramed sends a single packet to the client as its own datagram,
+// applying the length prefix if the client negotiated aggregation.
+// Ownership of the buffer passes to the send path.
+func (sh *shard) sendFramed(c *client, b *pool.Buffer) {
+	if len(b.Data) > c.mtu {
+		metricOversizeDrops.Add(1)
+		b.Release()
+		return
+	}
+	if c.aggregated {
+		n := len(b.Data)
+		if n+2 > pool.BufferSize {
+			// Too large to prefix in place; rare enough that an
+			// allocation is fine.
+			framed := make([]byte, n+2)
+			framed[0] = byte(n >> 8)
+			framed[1] = byte(n & 0xff)
+			copy(framed[2:], b.Data)
+			b.Release()
+			sh.sendToClient(c, framed)
+			return
+		}
+		b.Data = b.Data[0 : n+2]
+		copy(b.Data[2:], b.Data[0:n])
+		b.Data[0] = byte(n >> 8)
+		b.Data[1] = byte(n & 0xff)
+	}
+	sh.sendBufferToClient(c, b)
+}
+
+// appendPacket adds a packet to the client's aggregation buffer,
+// flushing first if it would not fit, and releases the packet buffer.
+// Must only be called while holding the client's sendPending flag.
+func (sh *shard) appendPacket(c *client, b *pool.Buffer) {
+	if len(b.Data) > c.mtu {
+		metricOversizeDrops.Add(1)
+		b.Release()
+		return
+	}
+	if !c.aggregated {
+		sh.sendBufferToClient(c, b)
+		return
+	}
+	if len(c.aggBuf)+2+len(b.Data) > aggregateMTU {
+		sh.flushAggregated(c)
+	}
+	n := len(b.Data)
+	c.aggBuf = append(c.aggBuf, byte(n>>8), byte(n&0xff))
+	c.aggBuf = append(c.aggBuf, b.Data...)
+	b.Release()
+}
+
+// flushAggregated sends everything accumulated in the client's
+// aggregation buffer as one datagram. Must only be called while holding
+// the client's sendPending flag.
+func (sh *shard) flushAggregated(c *client) {
+	if len(c.aggBuf) == 0 {
+		return
+	}
+	sh.sendToClient(c, c.aggBuf)
+	c.aggBuf = c.aggBuf[:0]
+}
+
 // runClient continually copies packets from the client's node and sends them
 // to the connected UDP client. The function will only return when the client's
-// network node is Close()d.
-func (s *Server) runClient(c *client) {
-	var buf [1500]byte
+// network node is Close()d. It is only used for nodes that do not support
+// event-driven reads; otherwise the shard's sender workers do this job
+// without needing a goroutine per client.
+func (sh *shard) runClient(c *client) {
+	if pr, ok := c.node.(network.PacketReader); ok {
+		// Packets are handed over as pooled buffers; ownership
+		// passes from the node's delivery queue to the send path
+		// without a copy.
+		for {
+			b, err := pr.ReadPacket()
+			switch {
+			case err == nil:
+				sh.sendFramed(c, b)
+			case err == io.EOF:
+				return
+			default:
+				// Other errors are ignored.
+			}
+		}
+	}
+	buf := make([]byte, pool.BufferSize)
 	for {
-		packetLen, err := c.node.Read(buf[:])
+		packetLen, err := c.node.Read(buf)
 		switch {
 		case err == nil:
-			s.socket.WriteToUDP(buf[0:packetLen], c.addr)
+			b := pool.Get()
+			b.Data = b.Data[0:packetLen]
+			copy(b.Data, buf[0:packetLen])
+			sh.sendFramed(c, b)
 		case err == io.EOF:
 			return
 		default:
@@ -98,183 +550,377 @@ func (s *Server) runClient(c *client) {
 	}
 }
 
+// notifyClient is invoked when a packet arrives on the client's
+// previously-empty queue; it hands the client to a sender worker unless
+// one is already servicing it.
+func (sh *shard) notifyClient(c *client) {
+	if !atomic.CompareAndSwapInt32(&c.sendPending, 0, 1) {
+		return
+	}
+	sh.sendMu.Lock()
+	sh.readyClients = append(sh.readyClients, c)
+	sh.sendMu.Unlock()
+	select {
+	case sh.sendWake <- struct{}{}:
+	default:
+	}
+}
+
+// drainClient sends every packet queued for the given client. Only one
+// worker services a client at a time: the client's sendPending flag is
+// held while draining and reacquired if new packets raced with clearing
+// it. For aggregated clients, packets drained in one burst coalesce
+// into shared datagrams, flushed when they reach the MTU or the burst
+// ends.
+func (sh *shard) drainClient(c *client) {
+	for {
+		b, err := c.qr.TryReadPacket()
+		if err != nil {
+			sh.flushAggregated(c)
+			return
+		}
+		if b != nil {
+			sh.appendPacket(c, b)
+			continue
+		}
+		// The queue is empty; flush before clearing the pending flag
+		// since the aggregation buffer must only be touched while
+		// the flag is held.
+		sh.flushAggregated(c)
+		atomic.StoreInt32(&c.sendPending, 0)
+		// A packet may have been delivered between the last read and
+		// clearing the flag, in which case no notification was sent.
+		b, err = c.qr.TryReadPacket()
+		if err != nil || b == nil {
+			return
+		}
+		sh.sendFramed(c, b)
+		if !atomic.CompareAndSwapInt32(&c.sendPending, 0, 1) {
+			// A notification requeued the client; let that
+			// entry take over the rest of the queue.
+			return
+		}
+	}
+}
+
+// senderWorker services the outbound queues of clients as they become
+// ready, in a small fixed pool instead of a goroutine per client.
+func (sh *shard) senderWorker() {
+	for {
+		<-sh.sendWake
+		for {
+			sh.sendMu.Lock()
+			ready := sh.readyClients
+			closed := sh.senderClosed
+			sh.readyClients = nil
+			sh.sendMu.Unlock()
+			if len(ready) == 0 {
+				if closed {
+					return
+				}
+				break
+			}
+			for _, c := range ready {
+				sh.drainClient(c)
+			}
+		}
+	}
+}
+
 // newClient processes a registration packet, adding a new client if necessary.
-func (s *Server) newClient(header *ipx.Header, addr *net.UDPAddr) {
-	addrStr := addr.String()
-	c, ok := s.clients[addrStr]
+func (sh *shard) newClient(header *ipx.Header, key clientKey, addr *net.UDPAddr, packet []byte) {
+	offered, requestedMTU := parseExtensions(packet)
+
+	// Grant a negotiated packet size within what our buffers can
+	// carry; requests too small to be useful are refused outright.
+	grantedMTU := 0
+	if offered&extensionFlagLargeMTU != 0 {
+		grantedMTU = requestedMTU
+		if grantedMTU > pool.BufferSize {
+			grantedMTU = pool.BufferSize
+		}
+		if grantedMTU < minNegotiableMTU {
+			grantedMTU = 0
+		}
+	}
+
+	sh.mu.Lock()
+	c, ok := sh.clients[key]
 
 	if !ok {
+		now := time.Now().UnixNano()
 		c = &client{
 			addr:            addr,
-			lastReceiveTime: time.Now(),
-			node:            s.net.NewNode(),
+			key:             key,
+			lastReceiveTime: now,
+			limiter:         newClientLimiter(sh.server.config, now),
+			node:            sh.server.net.NewNode(),
+			mtu:             pool.DefaultBufferSize,
+			aggregated:      offered&supportedExtensions&extensionFlagAggregation != 0,
+		}
+		if grantedMTU != 0 {
+			c.mtu = grantedMTU
+		}
+		if c.aggregated {
+			// An oversized packet is flushed on its own, so the
+			// buffer never grows beyond one maximum-size packet
+			// plus its prefix.
+			c.aggBuf = make([]byte, 0, pool.BufferSize+2)
+		}
+		if sh.server.config.ConnectedSockets {
+			// Give the client its own connected socket sharing the
+			// server port; on failure we silently fall back to the
+			// shared socket.
+			laddr := sh.socket.LocalAddr().(*net.UDPAddr)
+			if conn, err := dialReusePort(laddr, addr); err == nil {
+				c.conn = conn
+				go sh.runClientSocket(c)
+			}
 		}
 
-		s.clients[addrStr] = c
-		go s.runClient(c)
-	}
-
-	// Send a reply back to the client
-	reply := &ipx.Header{
-		Checksum:     0xffff,
-		Length:       30,
-		TransControl: 0,
-		Dest: ipx.HeaderAddr{
-			Network: [4]byte{0, 0, 0, 0},
-			Addr:    c.node.Address(),
-			Socket:  2,
-		},
-		Src: ipx.HeaderAddr{
-			Network: [4]byte{0, 0, 0, 1},
-			Addr:    ipx.AddrBroadcast,
-			Socket:  2,
-		},
+		sh.clients[key] = c
+		if qr, ok := c.node.(network.QueuedReader); ok {
+			// Event-driven delivery: sender workers service the
+			// client's queue when packets arrive, so no per-client
+			// goroutine is needed.
+			c.qr = qr
+			cc := c
+			qr.SetReadNotify(func() { sh.notifyClient(cc) })
+		} else {
+			go sh.runClient(c)
+		}
+		sh.startClientTimers(c)
 	}
-
-	c.lastSendTime = time.Now()
-	encodedReply, err := reply.MarshalBinary()
-	if err == nil {
-		s.socket.WriteToUDP(encodedReply, c.addr)
+	sh.mu.Unlock()
+
+	// Send a reply back to the client: the cached template with the
+	// client's node address patched in.
+	atomic.StoreInt64(&c.lastSendTime, time.Now().UnixNano())
+	var encodedReply [ipx.HeaderLength + 8]byte
+	copy(encodedReply[:], replyTemplate)
+	nodeAddr := c.node.Address()
+	copy(encodedReply[replyNodeOffset:replyNodeOffset+6], nodeAddr[:])
+	replyLen := ipx.HeaderLength
+	if offered != 0 {
+		// Acknowledge the extensions we accepted. The reply
+		// itself is always sent unaggregated, since it is
+		// what completes the negotiation.
+		var accepted uint16
+		if c.aggregated {
+			accepted |= extensionFlagAggregation
+		}
+		if offered&extensionFlagLargeMTU != 0 && grantedMTU != 0 {
+			// Report the client's actual limit, which for a
+			// client re-registering is whatever was granted
+			// the first time.
+			accepted |= extensionFlagLargeMTU
+		}
+		copy(encodedReply[ipx.HeaderLength:], extensionMagic[:])
+		encodedReply[ipx.HeaderLength+4] = byte(accepted >> 8)
+		encodedReply[ipx.HeaderLength+5] = byte(accepted & 0xff)
+		replyLen += 6
+		if accepted&extensionFlagLargeMTU != 0 {
+			encodedReply[ipx.HeaderLength+6] = byte(c.mtu >> 8)
+			encodedReply[ipx.HeaderLength+7] = byte(c.mtu & 0xff)
+			replyLen += 2
+		}
 	}
+	sh.sendToClient(c, encodedReply[0:replyLen])
 }
 
 // processPacket decodes and processes a received UDP packet, sending responses
 // and forwarding the packet on to other clients as appropriate.
-func (s *Server) processPacket(packet []byte, addr *net.UDPAddr) {
+func (sh *shard) processPacket(packet []byte, addr *net.UDPAddr) {
+	metricRXPackets.Add(1)
+	metricRXBytes.Add(uint64(len(packet)))
 	var header ipx.Header
 	if err := header.UnmarshalBinary(packet); err != nil {
 		return
 	}
+	key, ok := makeClientKey(addr)
+	if !ok {
+		return
+	}
 
 	if header.IsRegistrationPacket() {
-		s.newClient(&header, addr)
+		sh.newClient(&header, key, addr, packet)
 		return
 	}
 
 	// Find which client sent it; it must be a registered client sending
 	// from their own IPX address.
-	srcClient, ok := s.clients[addr.String()]
+	sh.mu.Lock()
+	srcClient, ok := sh.clients[key]
+	sh.mu.Unlock()
 	if !ok {
-		return
+		// After a state restore the client may be parked on another
+		// shard; if so, take it over.
+		srcClient = sh.adoptClient(key)
+		if srcClient == nil {
+			metricUnknownClientDrops.Add(1)
+			return
+		}
 	}
 	if header.Src.Addr != srcClient.node.Address() {
+		metricUnknownClientDrops.Add(1)
+		return
+	}
+	// The client is alive even if the packet ends up rate-limited.
+	now := time.Now().UnixNano()
+	atomic.StoreInt64(&srcClient.lastReceiveTime, now)
+	srcClient.limiterMu.Lock()
+	ok = srcClient.limiter.spend(now, len(packet), header.IsBroadcast())
+	srcClient.limiterMu.Unlock()
+	if !ok {
+		metricRateLimitDrops.Add(1)
 		return
 	}
 	// Deliver packet to the network.
-	srcClient.lastReceiveTime = time.Now()
 	srcClient.node.Write(packet)
 }
 
-// sendPing transmits a ping packet to the given client. The DOSbox IPX client
-// code recognizes broadcast packets sent to socket=2 and will send a reply to
-// the source address that we provide.
-func (s *Server) sendPing(c *client) {
-	header := &ipx.Header{
-		Dest: ipx.HeaderAddr{
-			Addr:   ipx.AddrBroadcast,
-			Socket: 2,
-		},
-		// We "send" the pings from an imaginary "ping reply" address
-		// because if we used ipx.AddrNull the reply would be
-		// indistinguishable from a registration packet.
-		Src: ipx.HeaderAddr{
-			Addr:   addrPingReply,
-			Socket: 0,
-		},
+// processClientPacket processes a packet received on a client's connected
+// socket. The kernel has already demultiplexed the flow for us, so no
+// clients map lookup is needed.
+func (sh *shard) processClientPacket(c *client, packet []byte) {
+	metricRXPackets.Add(1)
+	metricRXBytes.Add(uint64(len(packet)))
+	var header ipx.Header
+	if err := header.UnmarshalBinary(packet); err != nil {
+		return
 	}
-
-	c.lastSendTime = time.Now()
-	encodedHeader, err := header.MarshalBinary()
-	if err == nil {
-		s.socket.WriteToUDP(encodedHeader, c.addr)
+	if header.IsRegistrationPacket() {
+		// A lost reply makes the client retransmit; newClient finds
+		// the existing entry and resends the reply.
+		sh.newClient(&header, c.key, c.addr, packet)
+		return
+	}
+	if header.Src.Addr != c.node.Address() {
+		metricUnknownClientDrops.Add(1)
+		return
+	}
+	now := time.Now().UnixNano()
+	atomic.StoreInt64(&c.lastReceiveTime, now)
+	c.limiterMu.Lock()
+	ok := c.limiter.spend(now, len(packet), header.IsBroadcast())
+	c.limiterMu.Unlock()
+	if !ok {
+		metricRateLimitDrops.Add(1)
+		return
 	}
+	c.node.Write(packet)
 }
 
-// checkClientTimeouts checks all clients that are connected to the server and
-// handles idle clients to which we have no sent data or from which we have not
-// received data recently. This function should be called regularly; it returns
-// the time that it should next be invoked.
-func (s *Server) checkClientTimeouts() time.Time {
-	now := time.Now()
-
-	// At absolute max we should check again in 10 seconds, as a new client
-	// might connect in the mean time.
-	nextCheckTime := now.Add(10 * time.Second)
-
-	for _, c := range s.clients {
-		// Nothing sent in a while? Send a keepalive.
-		// This is important because some types of game use a
-		// client/server type arrangement where the server does not
-		// broadcast anything but listens for broadcasts from clients.
-		// An example is Warcraft 2. If there is no activity between
-		// the client and server in a long time, some NAT gateways or
-		// firewalls can drop the association.
-		keepaliveTime := c.lastSendTime.Add(s.config.KeepaliveTime)
-		if now.After(keepaliveTime) {
-			// We send a keepalive in the form of a ping packet
-			// that the client should respond to, thus keeping us
-			// from timing out the client from our own table if it
-			// really is still there.
-			s.sendPing(c)
-			keepaliveTime = c.lastSendTime.Add(s.config.KeepaliveTime)
-		}
-
-		// Nothing received in a long time? Time out the connection.
-		timeoutTime := c.lastReceiveTime.Add(s.config.ClientTimeout)
-		if now.After(timeoutTime) {
-			delete(s.clients, c.addr.String())
-			c.node.Close()
-		}
-
-		if keepaliveTime.Before(nextCheckTime) {
-			nextCheckTime = keepaliveTime
-		}
-		if timeoutTime.Before(nextCheckTime) {
-			nextCheckTime = timeoutTime
+// runClientSocket receives packets from the client's connected socket
+// until it is closed when the client is disconnected.
+func (sh *shard) runClientSocket(c *client) {
+	buf := make([]byte, pool.BufferSize)
+	for {
+		n, err := c.conn.Read(buf)
+		if err != nil {
+			return
 		}
+		sh.processClientPacket(c, buf[0:n])
 	}
-
-	return nextCheckTime
 }
 
-// poll listens for new packets, blocking until one is received, or until
-// a timeout is reached.
-func (s *Server) poll() error {
-	var buf [1500]byte
+// sendPing transmits the precomputed ping packet to the given client.
+func (sh *shard) sendPing(c *client) {
+	atomic.StoreInt64(&c.lastSendTime, time.Now().UnixNano())
+	if c.aggregated {
+		// Post-registration datagrams to aggregated clients always
+		// carry length prefixes, pings included.
+		sh.sendToClient(c, pingPacketFramed)
+		return
+	}
+	sh.sendToClient(c, pingPacket)
+}
 
-	s.socket.SetReadDeadline(s.timeoutCheckTime)
-	packetLen, addr, err := s.socket.ReadFromUDP(buf[:])
+// poll listens for new packets, blocking until one is received. Client
+// keepalives and timeouts are handled by the shard's timer goroutine, so
+// the receive loop never stalls on walking the client table.
+func (sh *shard) poll() error {
+	var packet []byte
+	var addr *net.UDPAddr
+	var err error
+
+	if sh.rx != nil {
+		packet, addr, err = sh.rx.read()
+	} else {
+		var packetLen int
+		packetLen, addr, err = sh.socket.ReadFromUDP(sh.readBuf)
+		packet = sh.readBuf[0:packetLen]
+	}
 
 	if err == nil {
-		s.processPacket(buf[0:packetLen], addr)
+		sh.processPacket(packet, addr)
 	} else if nerr, ok := err.(net.Error); ok && !nerr.Timeout() {
 		return err
 	}
 
-	// We must regularly call checkClientTimeouts(); when we do, update
-	// server.timeoutCheckTime with the next time it should be invoked.
-	if time.Now().After(s.timeoutCheckTime) {
-		s.timeoutCheckTime = s.checkClientTimeouts()
-	}
-
 	return nil
 }
 
-// Run runs the server, blocking until the socket is closed or an error occurs.
-func (s *Server) Run() {
+// run runs the shard's receive loop until its socket is closed or an error
+// occurs.
+func (sh *shard) run() {
 	for {
-		if err := s.poll(); err != nil {
+		if err := sh.poll(); err != nil {
 			return
 		}
 	}
 }
 
-// Close closes the socket associated with the server to shut it down.
+// Run runs the server, blocking until the sockets are closed or an error
+// occurs. Each shard runs its own receive loop in its own goroutine.
+func (s *Server) Run() {
+	var wg sync.WaitGroup
+	for _, sh := range s.shards {
+		wg.Add(1)
+		go func(sh *shard) {
+			sh.run()
+			wg.Done()
+		}(sh)
+	}
+	wg.Wait()
+}
+
+// Close closes the sockets associated with the server to shut it down.
 func (s *Server) Close() error {
 	s.mu.Lock()
 	defer s.mu.Unlock()
-	for _, client := range s.clients {
-		client.node.Close()
+	var err error
+	for _, sh := range s.shards {
+		sh.mu.Lock()
+		for _, client := range sh.clients {
+			client.node.Close()
+			if client.conn != nil {
+				client.conn.Close()
+			}
+		}
+		sh.mu.Unlock()
+		sh.sendMu.Lock()
+		sh.senderClosed = true
+		sh.sendMu.Unlock()
+		sh.timerMu.Lock()
+		sh.timerClosed = true
+		sh.timerMu.Unlock()
+		select {
+		case sh.timerWake <- struct{}{}:
+		default:
+		}
+		for i := 0; i < numSenderWorkers; i++ {
+			select {
+			case sh.sendWake <- struct{}{}:
+			default:
+			}
+		}
+		if sh.tx != nil {
+			sh.tx.close()
+		}
+		if cerr := sh.socket.Close(); cerr != nil && err == nil {
+			err = cerr
+		}
 	}
-	return s.socket.Close()
+	return err
 }
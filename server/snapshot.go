@@ -0,0 +1,222 @@
+// Saving and restoring the client table across a server restart, so that
+// a binary upgrade does not force every client back through registration.
+// The snapshot records each client's UDP address, assigned IPX address,
+// negotiated extensions and activity timestamps; everything else (rate
+// limiter state, queued packets) is transient and rebuilt fresh.
+package server
+
+import (
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"sync/atomic"
+	"time"
+
+	"github.com/fragglet/ipxbox/ipx"
+	"github.com/fragglet/ipxbox/network"
+	"github.com/fragglet/ipxbox/pool"
+)
+
+// Snapshot file format: the magic and version followed by a record
+// count, then one fixed-size record per client. All values are
+// big-endian.
+var snapshotMagic = [4]byte{'I', 'P', 'X', 'S'}
+
+const (
+	snapshotVersion      = 1
+	snapshotHeaderLength = 10
+	clientRecordLength   = 31
+
+	// Record flag bits.
+	snapshotFlagAggregated = 0x01
+)
+
+// appendInt64 appends a 64-bit value in big-endian byte order.
+func appendInt64(out []byte, v int64) []byte {
+	return append(out, byte(v>>56), byte(v>>48), byte(v>>40), byte(v>>32),
+		byte(v>>24), byte(v>>16), byte(v>>8), byte(v))
+}
+
+// readInt64 reads a 64-bit value in big-endian byte order.
+func readInt64(data []byte) int64 {
+	return int64(data[0])<<56 | int64(data[1])<<48 | int64(data[2])<<40 |
+		int64(data[3])<<32 | int64(data[4])<<24 | int64(data[5])<<16 |
+		int64(data[6])<<8 | int64(data[7])
+}
+
+// appendClientRecord appends the snapshot record for a client.
+func appendClientRecord(out []byte, c *client) []byte {
+	out = append(out, c.key.ip[:]...)
+	out = append(out, byte(c.key.port>>8), byte(c.key.port))
+	addr := c.node.Address()
+	out = append(out, addr[:]...)
+	var flags byte
+	if c.aggregated {
+		flags |= snapshotFlagAggregated
+	}
+	out = append(out, flags)
+	out = append(out, byte(c.mtu>>8), byte(c.mtu))
+	out = appendInt64(out, atomic.LoadInt64(&c.lastReceiveTime))
+	out = appendInt64(out, atomic.LoadInt64(&c.lastSendTime))
+	return out
+}
+
+// SaveState serializes the server's client table to the given writer so
+// that a future server process can restore it with RestoreState. It
+// should be called when the server is shutting down; clients that
+// register while a save is in progress may be missed.
+func (s *Server) SaveState(w io.Writer) error {
+	var clients []*client
+	for _, sh := range s.shards {
+		sh.mu.Lock()
+		for _, c := range sh.clients {
+			clients = append(clients, c)
+		}
+		sh.mu.Unlock()
+	}
+
+	out := make([]byte, 0, snapshotHeaderLength+len(clients)*clientRecordLength)
+	out = append(out, snapshotMagic[:]...)
+	out = append(out, 0, snapshotVersion)
+	count := uint32(len(clients))
+	out = append(out, byte(count>>24), byte(count>>16), byte(count>>8), byte(count))
+	for _, c := range clients {
+		out = appendClientRecord(out, c)
+	}
+	_, err := w.Write(out)
+	return err
+}
+
+// restoreClient rebuilds a single client from its snapshot record,
+// placing it on the given shard. This mirrors the wiring done by
+// newClient for a registering client, but sends no registration reply:
+// from the client's point of view nothing has happened.
+func (sh *shard) restoreClient(rec []byte, restorer network.NodeRestorer) error {
+	var key clientKey
+	copy(key.ip[:], rec[0:4])
+	key.port = uint16(rec[4])<<8 | uint16(rec[5])
+	var nodeAddr ipx.Addr
+	copy(nodeAddr[:], rec[6:12])
+	flags := rec[12]
+	mtu := int(rec[13])<<8 | int(rec[14])
+	lastReceiveTime := readInt64(rec[15:23])
+	lastSendTime := readInt64(rec[23:31])
+
+	node, err := restorer.NewNodeWithAddress(nodeAddr)
+	if err != nil {
+		return fmt.Errorf("restoring node %v: %v", nodeAddr, err)
+	}
+
+	if mtu > pool.BufferSize {
+		// The new process may have been started with a smaller -mtu
+		// than the one that granted this client its packet size.
+		mtu = pool.BufferSize
+	}
+	c := &client{
+		addr: &net.UDPAddr{
+			IP:   net.IPv4(key.ip[0], key.ip[1], key.ip[2], key.ip[3]),
+			Port: int(key.port),
+		},
+		key:             key,
+		node:            node,
+		lastReceiveTime: lastReceiveTime,
+		lastSendTime:    lastSendTime,
+		limiter:         newClientLimiter(sh.server.config, time.Now().UnixNano()),
+		mtu:             mtu,
+		aggregated:      flags&snapshotFlagAggregated != 0,
+	}
+	if c.aggregated {
+		c.aggBuf = make([]byte, 0, pool.BufferSize+2)
+	}
+	if sh.server.config.ConnectedSockets {
+		laddr := sh.socket.LocalAddr().(*net.UDPAddr)
+		if conn, err := dialReusePort(laddr, c.addr); err == nil {
+			c.conn = conn
+			go sh.runClientSocket(c)
+		}
+	}
+
+	sh.mu.Lock()
+	sh.clients[key] = c
+	if qr, ok := c.node.(network.QueuedReader); ok {
+		c.qr = qr
+		qr.SetReadNotify(func() { sh.notifyClient(c) })
+	} else {
+		go sh.runClient(c)
+	}
+	sh.mu.Unlock()
+	sh.startClientTimers(c)
+	return nil
+}
+
+// RestoreState rebuilds the client table from a snapshot written by
+// SaveState. It must be called after New but before Run, so that no
+// packets are processed against a half-restored table. Clients whose
+// node address cannot be re-registered are skipped; the affected client
+// re-registers the normal way once its keepalives go unanswered.
+func (s *Server) RestoreState(r io.Reader) error {
+	restorer, ok := s.net.(network.NodeRestorer)
+	if !ok {
+		return errors.New("network does not support restoring nodes")
+	}
+	data, err := io.ReadAll(r)
+	if err != nil {
+		return err
+	}
+	if len(data) < snapshotHeaderLength || [4]byte(data[0:4]) != snapshotMagic {
+		return errors.New("not a client state snapshot")
+	}
+	if version := int(data[4])<<8 | int(data[5]); version != snapshotVersion {
+		return fmt.Errorf("unsupported snapshot version %d", version)
+	}
+	count := int(data[6])<<24 | int(data[7])<<16 | int(data[8])<<8 | int(data[9])
+	if len(data) < snapshotHeaderLength+count*clientRecordLength {
+		return errors.New("truncated client state snapshot")
+	}
+
+	// Which shard's socket the kernel will deliver a client's packets
+	// to is not predictable from here, so clients are spread over the
+	// shards round-robin and adopted by the right shard when their
+	// first packet arrives.
+	var firstErr error
+	for i := 0; i < count; i++ {
+		rec := data[snapshotHeaderLength+i*clientRecordLength:]
+		sh := s.shards[i%len(s.shards)]
+		if err := sh.restoreClient(rec[0:clientRecordLength], restorer); err != nil && firstErr == nil {
+			firstErr = err
+		}
+	}
+	return firstErr
+}
+
+// adoptClient searches the other shards for a client with the given key
+// and takes it over, re-scheduling its deadline timers here; the old
+// shard's timer events find the client gone and expire. This only
+// happens after a state restore placed the client on a shard other than
+// the one the kernel's SO_REUSEPORT hash delivers its packets to.
+func (sh *shard) adoptClient(key clientKey) *client {
+	var c *client
+	for _, other := range sh.server.shards {
+		if other == sh {
+			continue
+		}
+		other.mu.Lock()
+		if found, ok := other.clients[key]; ok {
+			delete(other.clients, key)
+			c = found
+		}
+		other.mu.Unlock()
+		if c != nil {
+			break
+		}
+	}
+	if c == nil {
+		return nil
+	}
+	sh.mu.Lock()
+	sh.clients[key] = c
+	sh.mu.Unlock()
+	sh.startClientTimers(c)
+	return c
+}
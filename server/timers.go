@@ -0,0 +1,161 @@
+package server
+
+import (
+	"container/heap"
+	"sync/atomic"
+	"time"
+)
+
+// Kinds of client deadline events.
+const (
+	// Time to send a keepalive ping if nothing has been sent recently.
+	eventKeepalive = iota
+
+	// Time to disconnect the client if nothing has been received.
+	eventTimeout
+)
+
+// deadlineEvent is a pending deadline for a client in a shard's timer
+// heap. Events are lazily re-evaluated when they fire: the client's
+// timestamps may have moved the real deadline later, in which case the
+// event is simply pushed back. This way receiving or sending a packet
+// never has to touch the heap.
+type deadlineEvent struct {
+	when int64 // time.Time in nanoseconds.
+	kind int
+	c    *client
+}
+
+// deadlineHeap is a min-heap of deadline events ordered by expiry time,
+// implementing the container/heap interface.
+type deadlineHeap []deadlineEvent
+
+func (h deadlineHeap) Len() int            { return len(h) }
+func (h deadlineHeap) Less(i, j int) bool  { return h[i].when < h[j].when }
+func (h deadlineHeap) Swap(i, j int)       { h[i], h[j] = h[j], h[i] }
+func (h *deadlineHeap) Push(x interface{}) { *h = append(*h, x.(deadlineEvent)) }
+
+func (h *deadlineHeap) Pop() interface{} {
+	old := *h
+	n := len(old)
+	result := old[n-1]
+	*h = old[0 : n-1]
+	return result
+}
+
+// pushEvent adds a deadline event to the shard's timer heap, waking the
+// timer goroutine if this deadline is now the soonest.
+func (sh *shard) pushEvent(ev deadlineEvent) {
+	sh.timerMu.Lock()
+	heap.Push(&sh.timers, ev)
+	isMin := sh.timers[0] == ev
+	sh.timerMu.Unlock()
+	if isMin {
+		select {
+		case sh.timerWake <- struct{}{}:
+		default:
+		}
+	}
+}
+
+// startClientTimers schedules the keepalive and timeout deadlines for a
+// newly registered client.
+func (sh *shard) startClientTimers(c *client) {
+	now := time.Now().UnixNano()
+	keepalive := int64(sh.server.config.KeepaliveTime)
+	timeout := int64(sh.server.config.ClientTimeout)
+	sh.pushEvent(deadlineEvent{when: now + keepalive, kind: eventKeepalive, c: c})
+	sh.pushEvent(deadlineEvent{when: now + timeout, kind: eventTimeout, c: c})
+}
+
+// processDeadline handles a deadline event that has fired, re-scheduling
+// it based on the client's current timestamps.
+func (sh *shard) processDeadline(ev deadlineEvent) {
+	c := ev.c
+	// If the client has been disconnected its events just expire; this
+	// is how entries for departed clients leave the heap.
+	sh.mu.Lock()
+	_, ok := sh.clients[c.key]
+	sh.mu.Unlock()
+	if !ok {
+		return
+	}
+	now := time.Now().UnixNano()
+	switch ev.kind {
+	case eventKeepalive:
+		// Always send at least one packet every few seconds. This
+		// is important because some types of game use a
+		// client/server type arrangement where the server does not
+		// broadcast anything but listens for broadcasts from
+		// clients. An example is Warcraft 2. If there is no
+		// activity between the client and server in a long time,
+		// some NAT gateways or firewalls can drop the association.
+		due := atomic.LoadInt64(&c.lastSendTime) + int64(sh.server.config.KeepaliveTime)
+		if now >= due {
+			// We send a keepalive in the form of a ping packet
+			// that the client should respond to, thus keeping us
+			// from timing out the client from our own table if
+			// it really is still there.
+			sh.sendPing(c)
+			due = atomic.LoadInt64(&c.lastSendTime) + int64(sh.server.config.KeepaliveTime)
+		}
+		sh.pushEvent(deadlineEvent{when: due, kind: eventKeepalive, c: c})
+	case eventTimeout:
+		// Nothing received in a long time? Time out the connection.
+		due := atomic.LoadInt64(&c.lastReceiveTime) + int64(sh.server.config.ClientTimeout)
+		if now >= due {
+			sh.mu.Lock()
+			delete(sh.clients, c.key)
+			sh.mu.Unlock()
+			c.node.Close()
+			if c.conn != nil {
+				c.conn.Close()
+			}
+			return
+		}
+		sh.pushEvent(deadlineEvent{when: due, kind: eventTimeout, c: c})
+	}
+}
+
+// runTimers services the shard's deadline heap, sleeping until the next
+// deadline is due. Each wakeup only touches the clients whose deadlines
+// have actually expired, and keepalive pings are sent from here rather
+// than stalling the receive loop.
+func (sh *shard) runTimers() {
+	for {
+		sh.timerMu.Lock()
+		if sh.timerClosed {
+			sh.timerMu.Unlock()
+			return
+		}
+		var wait time.Duration
+		if len(sh.timers) == 0 {
+			wait = time.Hour
+		} else {
+			now := time.Now().UnixNano()
+			// Pop everything that has expired in one go: keepalive
+			// pings for clients whose deadlines fire together are
+			// then queued back to back and leave the socket in a
+			// single batched send.
+			var due []deadlineEvent
+			for len(sh.timers) > 0 && sh.timers[0].when <= now {
+				due = append(due, heap.Pop(&sh.timers).(deadlineEvent))
+			}
+			if len(due) > 0 {
+				sh.timerMu.Unlock()
+				for _, ev := range due {
+					sh.processDeadline(ev)
+				}
+				continue
+			}
+			wait = time.Duration(sh.timers[0].when - now)
+		}
+		sh.timerMu.Unlock()
+		timer := time.NewTimer(wait)
+		select {
+		case <-timer.C:
+		case <-sh.timerWake:
+			timer.Stop()
+		}
+	}
+}
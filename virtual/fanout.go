@@ -0,0 +1,118 @@
+package virtual
+
+import (
+	"fmt"
+	"runtime"
+	"strings"
+	"sync"
+
+	"github.com/fragglet/ipxbox/pool"
+)
+
+const (
+	// Broadcasts to at most this many targets are delivered inline on
+	// the caller's goroutine; the cost of handing off to the worker
+	// pool is only worth paying for larger fan-outs.
+	fanoutInlineLimit = 8
+
+	// Upper bound on the number of fan-out workers.
+	fanoutMaxWorkers = 8
+)
+
+// packetTarget is anything a packet can be fanned out to. deliverPacket
+// must not hold on to the buffer without taking its own reference.
+type packetTarget interface {
+	deliverPacket(b *pool.Buffer) error
+}
+
+// errorCollector accumulates error messages from concurrent deliveries.
+type errorCollector struct {
+	mu   sync.Mutex
+	errs []string
+}
+
+func (c *errorCollector) add(err error) {
+	c.mu.Lock()
+	c.errs = append(c.errs, err.Error())
+	c.mu.Unlock()
+}
+
+// fanoutJob is a slice of a broadcast: one packet to be delivered to a
+// subset of the targets.
+type fanoutJob struct {
+	packet  *pool.Buffer
+	targets []packetTarget
+	errs    *errorCollector
+	wg      *sync.WaitGroup
+}
+
+// fanout delivers one packet to many targets, splitting large fan-outs
+// across a small pool of worker goroutines so that the cost to the
+// sending goroutine stays roughly flat as the number of targets grows.
+type fanout struct {
+	jobs chan fanoutJob
+}
+
+// newFanout creates a fan-out engine with a worker per CPU, up to a
+// fixed maximum.
+func newFanout() *fanout {
+	workers := runtime.NumCPU()
+	if workers > fanoutMaxWorkers {
+		workers = fanoutMaxWorkers
+	}
+	f := &fanout{
+		jobs: make(chan fanoutJob),
+	}
+	for i := 0; i < workers; i++ {
+		go f.worker()
+	}
+	return f
+}
+
+func (f *fanout) worker() {
+	for job := range f.jobs {
+		deliverAll(job.packet, job.targets, job.errs)
+		job.wg.Done()
+	}
+}
+
+// deliverAll delivers the packet to each target sequentially.
+func deliverAll(packet *pool.Buffer, targets []packetTarget, errs *errorCollector) {
+	for _, target := range targets {
+		if err := target.deliverPacket(packet); err != nil {
+			errs.add(err)
+		}
+	}
+}
+
+// deliver hands the given packet to all of the given targets, using the
+// worker pool for large fan-outs. It blocks until every delivery has
+// completed; the caller keeps its own reference to the buffer.
+func (f *fanout) deliver(packet *pool.Buffer, targets []packetTarget) error {
+	errs := &errorCollector{}
+	if len(targets) <= fanoutInlineLimit {
+		deliverAll(packet, targets, errs)
+	} else {
+		var wg sync.WaitGroup
+		chunkSize := (len(targets) + fanoutMaxWorkers - 1) / fanoutMaxWorkers
+		for len(targets) > 0 {
+			count := chunkSize
+			if count > len(targets) {
+				count = len(targets)
+			}
+			wg.Add(1)
+			f.jobs <- fanoutJob{
+				packet:  packet,
+				targets: targets[0:count],
+				errs:    errs,
+				wg:      &wg,
+			}
+			targets = targets[count:]
+		}
+		wg.Wait()
+	}
+	if len(errs.errs) > 0 {
+		return fmt.Errorf("errors when forwarding broadcast packets: %v", strings.Join(errs.errs, "; "))
+	}
+	return nil
+}
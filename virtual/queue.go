@@ -0,0 +1,216 @@
+package virtual
+
+import (
+	"io"
+	"sync"
+
+	"github.com/fragglet/ipxbox/metrics"
+	"github.com/fragglet/ipxbox/pool"
+)
+
+var (
+	// Total number of packets currently sitting in delivery queues,
+	// summed over every node on every network.
+	metricQueueDepth = metrics.NewGauge("ipxbox.virtual.queue_depth")
+
+	// Packets dropped from delivery queues because the consumer was
+	// too slow to drain them.
+	metricQueueDrops = metrics.NewCounter("ipxbox.virtual.queue_drops")
+
+	// As above, but for taps; counted separately since a lagging tap
+	// is routine and harmless, unlike a lagging node.
+	metricTapQueueDrops = metrics.NewCounter("ipxbox.virtual.tap_queue_drops")
+)
+
+// packetQueue is a bounded FIFO of packets used to deliver packets to a
+// node. Enqueueing never blocks: if the queue is full, the oldest queued
+// packet is dropped to make room and a drop counter is incremented. This
+// means that a slow or stalled consumer can never stall the rest of the
+// network; it only loses its own packets.
+//
+// Packets are held as reference-counted pooled buffers, so a broadcast
+// packet can sit on many queues without being copied per queue.
+type packetQueue struct {
+	mu      sync.Mutex
+	slots   []*pool.Buffer
+	head    int
+	count   int
+	dropped uint64
+	closed  bool
+	ready   chan struct{}
+	notify  func()
+
+	// dropMetric is the counter incremented when a packet is dropped.
+	dropMetric *metrics.Counter
+}
+
+// newPacketQueue creates a queue with the given number of slots.
+func newPacketQueue(capacity int) *packetQueue {
+	return &packetQueue{
+		slots:      make([]*pool.Buffer, capacity),
+		ready:      make(chan struct{}, 1),
+		dropMetric: metricQueueDrops,
+	}
+}
+
+// EnqueueBuffer adds the given buffer to the queue, taking ownership of
+// one reference to it, and wakes the consumer if it is waiting. If the
+// queue is full the oldest packet is dropped. The only error returned is
+// io.ErrClosedPipe after the queue is closed.
+func (q *packetQueue) EnqueueBuffer(b *pool.Buffer) error {
+	q.mu.Lock()
+	if q.closed {
+		q.mu.Unlock()
+		b.Release()
+		return io.ErrClosedPipe
+	}
+	if q.count == len(q.slots) {
+		q.slots[q.head].Release()
+		q.slots[q.head] = nil
+		q.head = (q.head + 1) % len(q.slots)
+		q.count--
+		q.dropped++
+		q.dropMetric.Add(1)
+		metricQueueDepth.Add(-1)
+	}
+	q.slots[(q.head+q.count)%len(q.slots)] = b
+	q.count++
+	metricQueueDepth.Add(1)
+	wasEmpty := q.count == 1
+	notify := q.notify
+	q.mu.Unlock()
+	select {
+	case q.ready <- struct{}{}:
+	default:
+	}
+	if wasEmpty && notify != nil {
+		notify()
+	}
+	return nil
+}
+
+// Enqueue copies the given packet into a pooled buffer and adds it to
+// the queue; the caller keeps ownership of the packet slice.
+func (q *packetQueue) Enqueue(packet []byte) error {
+	if len(packet) > pool.BufferSize {
+		// Oversized packets cannot be queued; count as a drop.
+		q.mu.Lock()
+		q.dropped++
+		q.mu.Unlock()
+		q.dropMetric.Add(1)
+		return nil
+	}
+	b := pool.Get()
+	b.Data = b.Data[0:len(packet)]
+	copy(b.Data, packet)
+	return q.EnqueueBuffer(b)
+}
+
+// DequeueBuffer removes and returns the next queued packet, blocking
+// until one arrives. Ownership of the buffer passes to the caller, which
+// must Release() it. Returns io.EOF once the queue has been closed.
+// There must only be a single consumer.
+func (q *packetQueue) DequeueBuffer() (*pool.Buffer, error) {
+	for {
+		q.mu.Lock()
+		if q.count > 0 {
+			b := q.slots[q.head]
+			q.slots[q.head] = nil
+			q.head = (q.head + 1) % len(q.slots)
+			q.count--
+			metricQueueDepth.Add(-1)
+			q.mu.Unlock()
+			return b, nil
+		}
+		closed := q.closed
+		q.mu.Unlock()
+		if closed {
+			return nil, io.EOF
+		}
+		<-q.ready
+	}
+}
+
+// TryDequeueBuffer removes and returns the next queued packet without
+// blocking; a nil buffer is returned if the queue is empty. Ownership of
+// the buffer passes to the caller, which must Release() it. Returns
+// io.EOF once the queue has been closed.
+func (q *packetQueue) TryDequeueBuffer() (*pool.Buffer, error) {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	if q.count > 0 {
+		b := q.slots[q.head]
+		q.slots[q.head] = nil
+		q.head = (q.head + 1) % len(q.slots)
+		q.count--
+		metricQueueDepth.Add(-1)
+		return b, nil
+	}
+	if q.closed {
+		return nil, io.EOF
+	}
+	return nil, nil
+}
+
+// SetNotify registers a function to be called whenever a packet is added
+// to the previously-empty queue. If packets are already queued the
+// function is invoked immediately: they may have been delivered between
+// the node becoming visible to the network and the notify function being
+// registered, and since later enqueues only notify on the empty to
+// non-empty transition, nothing else would ever announce them.
+func (q *packetQueue) SetNotify(notify func()) {
+	q.mu.Lock()
+	pending := q.count > 0
+	q.notify = notify
+	q.mu.Unlock()
+	if pending && notify != nil {
+		notify()
+	}
+}
+
+// Dequeue copies the next queued packet into data, blocking until a
+// packet arrives. It returns io.EOF once the queue has been closed.
+func (q *packetQueue) Dequeue(data []byte) (int, error) {
+	b, err := q.DequeueBuffer()
+	if err != nil {
+		return 0, err
+	}
+	n := copy(data, b.Data)
+	b.Release()
+	return n, nil
+}
+
+// deliverPacket implements the fan-out target interface, taking a new
+// reference to the buffer for the queue's own use.
+func (q *packetQueue) deliverPacket(b *pool.Buffer) error {
+	b.AddRef()
+	return q.EnqueueBuffer(b)
+}
+
+// Close closes the queue, releasing any packets still queued; the
+// consumer will get io.EOF and future Enqueue calls will fail.
+func (q *packetQueue) Close() error {
+	q.mu.Lock()
+	q.closed = true
+	for q.count > 0 {
+		q.slots[q.head].Release()
+		q.slots[q.head] = nil
+		q.head = (q.head + 1) % len(q.slots)
+		q.count--
+		metricQueueDepth.Add(-1)
+	}
+	q.mu.Unlock()
+	select {
+	case q.ready <- struct{}{}:
+	default:
+	}
+	return nil
+}
+
+// Dropped returns the number of packets dropped due to overflow since the
+// queue was created.
+func (q *packetQueue) Dropped() uint64 {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	return q.dropped
+}
@@ -5,13 +5,26 @@ package virtual
 import (
 	"crypto/rand"
 	"errors"
-	"fmt"
 	"io"
-	"strings"
 	"sync"
+	"time"
 
 	"github.com/fragglet/ipxbox/ipx"
+	"github.com/fragglet/ipxbox/metrics"
 	"github.com/fragglet/ipxbox/network"
+	"github.com/fragglet/ipxbox/pool"
+)
+
+// Counters instrumenting the forwarding path; these are atomics shared
+// by all networks.
+var (
+	metricBroadcastPackets = metrics.NewCounter("ipxbox.virtual.broadcast_packets")
+	metricUnicastPackets   = metrics.NewCounter("ipxbox.virtual.unicast_packets")
+	metricUnknownNodeDrops = metrics.NewCounter("ipxbox.virtual.unknown_node_drops")
+
+	// Time taken to forward a packet from a source to the delivery
+	// queues of all of its destinations.
+	metricForwardLatency = metrics.NewHistogram("ipxbox.virtual.forward_latency")
 )
 
 type Network struct {
@@ -19,25 +32,37 @@ type Network struct {
 	nodesByIPX map[ipx.Addr]*node
 	nextTapID  int
 	taps       map[int]*Tap
+	fanout     *fanout
 }
 
 type Tap struct {
-	net   *Network
-	pipeR *io.PipeReader
-	pipeW *io.PipeWriter
-	id    int
+	net *Network
+	rxq *packetQueue
+	id  int
 }
 
 type node struct {
-	net   *Network
-	addr  ipx.Addr
-	pipeR *io.PipeReader
-	pipeW *io.PipeWriter
+	net  *Network
+	addr ipx.Addr
+	rxq  *packetQueue
 }
 
+// Number of packets that can be queued for delivery to each node
+// before the oldest starts being dropped.
+const nodeQueueSize = 64
+
+// Number of packets that can be queued for delivery to each tap. Taps
+// are observers of the network, so they get a deeper queue to ride out
+// pauses in the consumer, but a lagging tap only ever loses its own
+// packets; it can never stall the switch.
+const tapQueueSize = 256
+
 var (
 	_ = (network.Network)(&Network{})
+	_ = (network.NodeRestorer)(&Network{})
 	_ = (network.Node)(&node{})
+	_ = (network.PacketReader)(&node{})
+	_ = (network.QueuedReader)(&node{})
 	_ = (io.ReadWriteCloser)(&Tap{})
 
 	// UnknownNodeError is returned by Network.Write() if the destination
@@ -48,7 +73,7 @@ var (
 // Close removes the node from its parent network; future calls to Read() will
 // return EOF and packets sent to its address will not be delivered.
 func (n *node) Close() error {
-	n.pipeW.Close()
+	n.rxq.Close()
 	n.net.mu.Lock()
 	delete(n.net.nodesByIPX, n.addr)
 	n.net.mu.Unlock()
@@ -57,7 +82,25 @@ func (n *node) Close() error {
 
 // Read reads a packet from the network for this node.
 func (n *node) Read(data []byte) (int, error) {
-	return n.pipeR.Read(data)
+	return n.rxq.Dequeue(data)
+}
+
+// ReadPacket reads a packet from the network for this node as a pooled
+// buffer, transferring ownership to the caller without a copy.
+func (n *node) ReadPacket() (*pool.Buffer, error) {
+	return n.rxq.DequeueBuffer()
+}
+
+// TryReadPacket reads a packet from the network for this node without
+// blocking, returning nil if none is queued.
+func (n *node) TryReadPacket() (*pool.Buffer, error) {
+	return n.rxq.TryDequeueBuffer()
+}
+
+// SetReadNotify registers a function called when a packet arrives for
+// this node, allowing event-driven consumption of the delivery queue.
+func (n *node) SetReadNotify(notify func()) {
+	n.rxq.SetNotify(notify)
 }
 
 // Write writes a packet into the network from the given node.
@@ -73,7 +116,7 @@ func (n *node) Address() ipx.Addr {
 // Close removes the tap from the network; no more packets will be delivered
 // to it and all future calls to Read() will return EOF.
 func (t *Tap) Close() error {
-	t.pipeW.Close()
+	t.rxq.Close()
 	t.net.mu.Lock()
 	delete(t.net.taps, t.id)
 	t.net.mu.Unlock()
@@ -82,7 +125,7 @@ func (t *Tap) Close() error {
 
 // Read reads a packet from the network tap.
 func (t *Tap) Read(data []byte) (int, error) {
-	return t.pipeR.Read(data)
+	return t.rxq.Dequeue(data)
 }
 
 // Write writes a packet into the network.
@@ -113,104 +156,127 @@ func (n *Network) addNode(node *node) {
 
 // NewNode creates a new node on the network.
 func (n *Network) NewNode() network.Node {
-	r, w := io.Pipe()
 	node := &node{
-		net:   n,
-		pipeR: r,
-		pipeW: w,
+		net: n,
+		rxq: newPacketQueue(nodeQueueSize),
 	}
 	n.addNode(node)
 	return node
 }
 
+// NewNodeWithAddress creates a new node with the given address, used to
+// restore nodes saved across a server restart. An error is returned if
+// the address is already in use.
+func (n *Network) NewNodeWithAddress(addr ipx.Addr) (network.Node, error) {
+	node := &node{
+		net:  n,
+		addr: addr,
+		rxq:  newPacketQueue(nodeQueueSize),
+	}
+	n.mu.Lock()
+	defer n.mu.Unlock()
+	if _, ok := n.nodesByIPX[addr]; ok {
+		return nil, errors.New("address already in use")
+	}
+	n.nodesByIPX[addr] = node
+	return node, nil
+}
+
 // forwardBroadcastPacket takes a broadcast packet received from a node and
 // forwards it to all other clients; however, it is never sent back to the
 // source node from which it came.
-func (n *Network) forwardBroadcastPacket(header *ipx.Header, packet []byte, src io.Writer) error {
-	errs := []string{}
-	nodes := []*node{}
+func (n *Network) forwardBroadcastPacket(packet *pool.Buffer, src io.Writer) error {
+	// The packet buffer is shared between the delivery queues of every
+	// other node; each queue takes its own reference, so the packet is
+	// never copied per node. Enqueueing never blocks, so a node whose
+	// owner is slow to read cannot stall delivery to the others. Large
+	// fan-outs are split across the fan-out worker pool.
+	targets := []packetTarget{}
 	n.mu.RLock()
 	for _, node := range n.nodesByIPX {
 		if node != src {
-			nodes = append(nodes, node)
+			targets = append(targets, node.rxq)
 		}
 	}
 	n.mu.RUnlock()
-	for _, node := range nodes {
-		// Packet is written into the delivery pipe for the node; the
-		// owner of the node will receive it by calling Read() on the
-		// node which reads from the other end of the pipe.
-		_, err := node.pipeW.Write(packet)
-		if err != nil {
-			errs = append(errs, err.Error())
-		}
-	}
-	if len(errs) > 0 {
-		return fmt.Errorf("errors when forwarding broadcast packets: %v", strings.Join(errs, "; "))
-	}
-	return nil
+	return n.fanout.deliver(packet, targets)
 }
 
 // forwardToTaps sends the given packet to all taps which are currently
 // listening to network traffic. We don't forward packets back to the source
-// that sent them, though.
-func (n *Network) forwardToTaps(packet []byte, src io.Writer) {
-	taps := []*Tap{}
+// that sent them, though. Delivery is to the taps' bounded queues and
+// never blocks; a tap whose consumer lags drops its oldest packets.
+func (n *Network) forwardToTaps(packet *pool.Buffer, src io.Writer) {
+	targets := []packetTarget{}
 	n.mu.RLock()
 	for _, tap := range n.taps {
 		if tap != src {
-			taps = append(taps, tap)
+			targets = append(targets, tap.rxq)
 		}
 	}
 	n.mu.RUnlock()
-	for _, tap := range taps {
-		tap.pipeW.Write(packet)
-	}
+	n.fanout.deliver(packet, targets)
 }
 
 // forwardPacket receives a packet and forwards it on to another node.
-func (n *Network) forwardPacket(header *ipx.Header, packet []byte, src io.Writer) error {
+func (n *Network) forwardPacket(dest ipx.Addr, packet *pool.Buffer, src io.Writer) error {
 	n.forwardToTaps(packet, src)
-	if header.IsBroadcast() {
-		return n.forwardBroadcastPacket(header, packet, src)
+	if dest == ipx.AddrBroadcast {
+		metricBroadcastPackets.Add(1)
+		return n.forwardBroadcastPacket(packet, src)
 	}
 
 	// We can only forward it on if the destination IPX address corresponds
 	// to a node that we know about:
 	n.mu.RLock()
-	node, ok := n.nodesByIPX[header.Dest.Addr]
+	node, ok := n.nodesByIPX[dest]
 	n.mu.RUnlock()
 	if !ok {
+		metricUnknownNodeDrops.Add(1)
 		return UnknownNodeError
 	}
-	_, err := node.pipeW.Write(packet)
-	return err
+	metricUnicastPackets.Add(1)
+	return node.rxq.deliverPacket(packet)
 }
 
 // writeFromSource writes a packet to the network, forwarding to the right
-// node as appropriate.
+// node as appropriate. Only the destination address is needed for routing,
+// so we peek at the addresses rather than decoding the whole header. The
+// packet is copied once into a pooled buffer that is then shared between
+// all of the queues it is delivered to.
 func (n *Network) writeFromSource(packet []byte, src io.Writer) (int, error) {
-	var header ipx.Header
-	if err := header.UnmarshalBinary(packet); err != nil {
+	dest, _, err := ipx.PeekAddresses(packet)
+	if err != nil {
 		return 0, err
 	}
-	if err := n.forwardPacket(&header, packet, src); err != nil {
+	if len(packet) > pool.BufferSize {
+		return 0, errors.New("packet too large to forward")
+	}
+	b := pool.Get()
+	b.Data = b.Data[0:len(packet)]
+	copy(b.Data, packet)
+	startTime := time.Now()
+	err = n.forwardPacket(dest, b, src)
+	metricForwardLatency.Observe(time.Since(startTime))
+	b.Release()
+	if err != nil {
 		return 0, err
 	}
 	return len(packet), nil
 }
 
 // Tap creates a new network tap for listening to network traffic.
-// The caller must call Read() on the tap regularly otherwise it may stall the
-// operation of the network.
+// A tap that is read too slowly drops packets rather than stalling the
+// network, so tapping a busy server is always safe; drops are counted
+// in the ipxbox.virtual.tap_queue_drops metric.
 func (n *Network) Tap() *Tap {
-	r, w := io.Pipe()
+	rxq := newPacketQueue(tapQueueSize)
+	rxq.dropMetric = metricTapQueueDrops
 	n.mu.Lock()
 	tap := &Tap{
-		id:    n.nextTapID,
-		net:   n,
-		pipeR: r,
-		pipeW: w,
+		id:  n.nextTapID,
+		net: n,
+		rxq: rxq,
 	}
 	n.nextTapID++
 	n.taps[tap.id] = tap
@@ -223,5 +289,6 @@ func New() *Network {
 	return &Network{
 		nodesByIPX: map[ipx.Addr]*node{},
 		taps:       map[int]*Tap{},
+		fanout:     newFanout(),
 	}
 }
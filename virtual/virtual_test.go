@@ -0,0 +1,171 @@
+package virtual
+
+import (
+	"fmt"
+	"io"
+	"sync"
+	"testing"
+
+	"github.com/fragglet/ipxbox/ipx"
+	"github.com/fragglet/ipxbox/network"
+)
+
+// makeTestPacket returns an encoded packet of the given total length sent
+// between the given addresses.
+func makeTestPacket(dest, src ipx.Addr, length int) []byte {
+	header := &ipx.Header{
+		Dest: ipx.HeaderAddr{Addr: dest, Socket: 0x1234},
+		Src:  ipx.HeaderAddr{Addr: src, Socket: 0x1234},
+	}
+	packet := make([]byte, length)
+	if err := header.MarshalTo(packet); err != nil {
+		panic(err)
+	}
+	return packet
+}
+
+func TestUnicastDelivery(t *testing.T) {
+	net := New()
+	node1 := net.NewNode()
+	node2 := net.NewNode()
+	defer node1.Close()
+	defer node2.Close()
+
+	packet := makeTestPacket(node2.Address(), node1.Address(), 64)
+	if _, err := node1.Write(packet); err != nil {
+		t.Fatalf("error writing packet: %v", err)
+	}
+	var buf [1500]byte
+	n, err := node2.Read(buf[:])
+	if err != nil {
+		t.Fatalf("error reading packet: %v", err)
+	}
+	if n != len(packet) {
+		t.Errorf("wrong packet length: want %d, got %d", len(packet), n)
+	}
+}
+
+func TestBroadcastDelivery(t *testing.T) {
+	net := New()
+	src := net.NewNode()
+	defer src.Close()
+	var others []network.Node
+	for i := 0; i < 4; i++ {
+		node := net.NewNode()
+		defer node.Close()
+		others = append(others, node)
+	}
+
+	packet := makeTestPacket(ipx.AddrBroadcast, src.Address(), 64)
+	if _, err := src.Write(packet); err != nil {
+		t.Fatalf("error writing packet: %v", err)
+	}
+	for i, node := range others {
+		var buf [1500]byte
+		if _, err := node.Read(buf[:]); err != nil {
+			t.Errorf("error reading from node %d: %v", i, err)
+		}
+	}
+	// The source must not receive its own broadcast.
+	if b, err := src.(network.QueuedReader).TryReadPacket(); err != nil || b != nil {
+		t.Errorf("source received its own broadcast")
+	}
+}
+
+func TestUnknownDestination(t *testing.T) {
+	net := New()
+	node := net.NewNode()
+	defer node.Close()
+
+	dest := ipx.Addr{0x02, 0x99, 0x99, 0x99, 0x99, 0x99}
+	packet := makeTestPacket(dest, node.Address(), 64)
+	if _, err := node.Write(packet); err != UnknownNodeError {
+		t.Errorf("want UnknownNodeError, got %v", err)
+	}
+}
+
+// drainNode consumes every packet delivered to the node until it is
+// closed, so that benchmarks measure delivery rather than queue overflow.
+func drainNode(node network.Node, wg *sync.WaitGroup) {
+	defer wg.Done()
+	pr := node.(network.PacketReader)
+	for {
+		b, err := pr.ReadPacket()
+		if err == io.EOF {
+			return
+		}
+		b.Release()
+	}
+}
+
+func benchmarkWrite(b *testing.B, numNodes int, broadcast bool) {
+	net := New()
+	var wg sync.WaitGroup
+	src := net.NewNode()
+	nodes := make([]network.Node, numNodes-1)
+	for i := range nodes {
+		nodes[i] = net.NewNode()
+		wg.Add(1)
+		go drainNode(nodes[i], &wg)
+	}
+	dest := ipx.AddrBroadcast
+	if !broadcast {
+		dest = nodes[0].Address()
+	}
+	packet := makeTestPacket(dest, src.Address(), 512)
+
+	b.SetBytes(int64(len(packet)))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := src.Write(packet); err != nil {
+			b.Fatal(err)
+		}
+	}
+	b.StopTimer()
+
+	src.Close()
+	for _, node := range nodes {
+		node.Close()
+	}
+	wg.Wait()
+}
+
+func BenchmarkWriteUnicast(b *testing.B) {
+	for _, numNodes := range []int{2, 20, 200} {
+		b.Run(fmt.Sprintf("%dnodes", numNodes), func(b *testing.B) {
+			benchmarkWrite(b, numNodes, false)
+		})
+	}
+}
+
+func BenchmarkWriteBroadcast(b *testing.B) {
+	for _, numNodes := range []int{2, 20, 200} {
+		b.Run(fmt.Sprintf("%dnodes", numNodes), func(b *testing.B) {
+			benchmarkWrite(b, numNodes, true)
+		})
+	}
+}
+
+func TestNotifyAfterDelivery(t *testing.T) {
+	net := New()
+	node1 := net.NewNode()
+	node2 := net.NewNode()
+	defer node1.Close()
+	defer node2.Close()
+
+	// Deliver a packet before the notify function is registered, as can
+	// happen to a broadcast sent while a new node is being wired up.
+	packet := makeTestPacket(node2.Address(), node1.Address(), 64)
+	if _, err := node1.Write(packet); err != nil {
+		t.Fatalf("error writing packet: %v", err)
+	}
+	notified := make(chan struct{}, 1)
+	node2.(network.QueuedReader).SetReadNotify(func() {
+		notified <- struct{}{}
+	})
+	select {
+	case <-notified:
+	default:
+		t.Errorf("no notification for packet queued before SetReadNotify")
+	}
+}